@@ -46,34 +46,13 @@ check_cmd:
     jump    @unknown_command
 
 check_string:
+    ; r0 = 0 if the r0 long string at [X] matches user input,
+    ; comparing the terminating \0 as well
     switchx #f
     load    [X], @user_input
     switchx #0
-
-csloop: ifeq    r0, #0
-    jump    @last_check
-
-    load    r2, [X]
-
-    switchx #f
-    load    r3, [X]
-    add     [X], #1
-
-    switchx #0
-    add     [X], #1
-
-    ifneq   r2, r3
-    ret
-
-    sub     r0, #1
-    jump    @csloop
-
-last_check:
-    switchx #f
-    load    r2, [X]
-    ifneq   r2, #0
-    load    r0, #1
-
+    add     r0, #1
+    mcmp    #0, #f, r0
     ret
 
 action_help:
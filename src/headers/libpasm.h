@@ -0,0 +1,43 @@
+// P Assembler - embedding interface
+#include <stddef.h>
+#define __PASM_VERSION__ "0.1"
+
+// an error in the source; line and col count from 1
+typedef struct {
+    unsigned int line, col;
+    char message[128];
+} pasm_diag;
+
+// what pasm_assemble made of a source: the program image, or
+// the errors found in it, at most one per line; and notes on it
+// that aren't errors
+typedef struct {
+    unsigned char* image;
+    size_t size;
+    pasm_diag* diags;
+    size_t ndiags;
+    pasm_diag* notes;
+    size_t nnotes;
+} pasm_result;
+
+// how to assemble: on jobs threads, for large sources, and with
+// the peephole optimizer if optimize is set, which may then inline
+// calls to small subroutines while the program grows by at most
+// inline_size bytes
+typedef struct {
+    unsigned int jobs;
+    char optimize;
+    unsigned int inline_size;
+} pasm_options;
+
+// assemble len bytes of source into result, 0 on success; it keeps
+// no state between calls, so threads may assemble at the same time
+char pasm_assemble(const char* source, size_t len, pasm_result* result);
+
+// the same with options; the image on several jobs is the same
+// as on one, errors are reported the same too
+char pasm_assemble_with(const char* source, size_t len,
+                        pasm_options* options, pasm_result* result);
+
+// free the image, diagnostics and notes of result
+void pasm_free(pasm_result* result);
@@ -0,0 +1,21 @@
+// P Virtual Machine - embedding interface
+#include <stdio.h>
+
+// A native function guest code reaches with `hostcall n': it gets
+// the registers, guest memory and the cell [X] points at, and passes
+// results back through them
+typedef void (*pvm_hostcall)(unsigned int* reg, unsigned int* memory,
+                             unsigned int* X);
+
+// make fn hostcall n
+void pvm_register(unsigned char n, pvm_hostcall fn);
+
+// set up VM memory, with depth entries in the call and data stacks
+// (0 for the default)
+void pvm_init(unsigned int depth);
+
+// load and verify a program image, 0 on success
+char pvm_load(FILE* fp);
+
+// run the loaded program, return its exit code
+unsigned int pvm_run(void);
@@ -1,19 +1,157 @@
-#include <stdio.h>
-#define EXIT_ASM_ERROR 2
-#define MAXLINES 0xFFFF
-#define MAXLABELSIZE 0xFFF
-#define __PASM_VERSION__ "0.1"
+// P Assembler - header file
+#include <pthread.h>
+#include <setjmp.h>
+#include "libpasm.h"
+// starting number of label slots, a power of two
+#define LABELSLOTS 0x100
 
+// a slot of the label table: open addressing on the hash of
+// the name, which lives at offset name in names[]; a label that is
+// used before it is defined has a slot that isn't defined yet
 typedef struct {
+    unsigned long hash;
+    size_t name;
     unsigned int address;
-    char label[MAXLABELSIZE];
+    char used, defined;
 } Label;
 
-Label lookup[MAXLINES];
-size_t LOOKUP_PT = 0;
+// a reference to a label not defined yet: the 16 bit address goes
+// in out[at] and out[at + 1] once it is, where line and col
+// of the source used it in instruction inst
+typedef struct {
+    size_t at, name;
+    unsigned long hash;
+    unsigned int line, col;
+    char* inst;
+} Fixup;
+
+// a piece of the source, len bytes from p; col counts from 1
+typedef struct {
+    const char* p;
+    size_t len;
+    unsigned int col;
+} Token;
+
+// where the lexer is: pos in the current line, which starts at bol
+// and ends at eol, before any comment; the next one starts at next.
+// line and col locate the last token read, for error messages
+typedef struct {
+    const char *pos, *bol, *eol, *next;
+    unsigned int line, col;
+} Lexer;
+
+// One way to write an instruction. kinds lists its operands:
+//   r  a register            #  a number
+//   a  #ADDR or @LABEL       @  a label
+//   X  the [X] cell
+// and fields where each one goes in code:
+//   x, y, k  the nibbles of xy0k     n  the nibble above k
+//   2, 3, 4  the low 8, 12, 16 bits  Y  y, not below x
+//   P  a `load [X]' word put before the instruction
+//   J  a `jump' word put after it, the branch target
+//   W  the constant of `load rx, #NUM', wide mode aware
+//   -  nowhere
+// Forms of one mnemonic are next to each other and tried in order.
+typedef struct {
+    char* name;
+    char* kinds;
+    char* fields;
+    unsigned long code;
+    // what an `ifeq'/`ifneq' becomes when a jump follows
+    unsigned long fused;
+} Form;
+
+// a line as assembled, for -O: its bytes at out[at], the form
+// it used, NULL for data, its nfix fixups from fixups[fix] on,
+// whether it comes right after an `ifeq'/`ifneq', which may skip it,
+// and for a `call' that is inlined, 1 + the item the subroutine
+// starts at
+typedef struct {
+    size_t at, size, fix, nfix, inlined;
+    Form* form;
+    char skipped, dead;
+} Item;
+
+// where the last `ifeq'/`ifneq' went, NOFUSE if it wasn't
+// the instruction just before, LEAD if a chunk has had none yet
+#define NOFUSE ((size_t)-1)
+#define LEAD ((size_t)-2)
+// the least source a chunk of a parallel assembly gets, and
+// the chunks handed out per thread
+#define CHUNKSIZE 0x10000
+#define CHUNKSPERJOB 4
+// the most bytes of a subroutine that -O inlines, its `ret' aside
+#define INLINESIZE 0x18
 
-FILE *fpasm, *fpbin;
-char *words[MAXLINES];
-char* PROGNAME = NULL;
+// one assembly, see pasm_assemble
+typedef struct {
+    const char* source;
+    size_t sourcelen;
+    Lexer lex;
+
+    Label* labels;
+    size_t nlabels, labelslots;
+    char* names;
+    size_t nameslen, namessize;
+
+    // the bytecode, and the label references to patch into it
+    unsigned char* out;
+    size_t outlen, outsize;
+    Fixup* fixups;
+    size_t nfixups, fixupsize;
+
+    // what the `ifeq'/`ifneq' at fuse_at becomes if a jump to
+    // a fixed address comes right after it
+    size_t fuse_at;
+    unsigned long fuse_word;
+    // set by `wide': registers are 32 bits, constants may be too
+    char wide;
+    // defer leaves every label to a fixup: set for -O, and in each
+    // chunk of a bigger source, see assemble_chunks; tail is set in
+    // all chunks but the first, lead_jump if the chunk starts with
+    // a jump that an `ifeq'/`ifneq' ending the chunk before fuses with,
+    // lead_long if with a longer instruction such a skip can't step over
+    char defer, tail, lead_jump, lead_long;
+
+    // -O: the lines assembled, the form of the last one, and
+    // the use of a fixed address that rules the optimizer out
+    // if fixedat is below the size of the program; inlining
+    // may add at most inline_size bytes to it
+    char optimize;
+    unsigned int inline_size;
+    Item* items;
+    size_t nitems, itemsize;
+    Form* form;
+    pasm_diag fixed;
+    unsigned int fixedat;
+
+    pasm_diag* diags;
+    size_t ndiags, diagsize;
+    pasm_diag* notes;
+    size_t nnotes, notesize;
+    // where an error goes to give up on the line, see pass
+    jmp_buf bail;
+} Pasm;
+
+// slots of the mnemonic hash, a power of two, see mnemonics
+#define MNEMONICSLOTS 0x400
+
+// a chunk of a parallel assembly: its own assembly of the lines
+// from source on, and where its output goes in the whole image
+typedef struct {
+    Pasm* as;
+    const char* source;
+    size_t len, base;
+    char failed;
+} Chunk;
 
-unsigned int linenum = 0;
+// what the threads of a parallel assembly share: the whole
+// assembly, its chunks, the next one to hand out, and what to
+// do with each in the current round
+typedef struct Pool Pool;
+struct Pool {
+    Pasm* all;
+    Chunk* chunks;
+    size_t nchunks, next;
+    void (*work)(Pool* pool, Chunk* c);
+};
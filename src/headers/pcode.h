@@ -0,0 +1,29 @@
+// P bytecode - what pvm and pdis both need to know about it
+
+/* is op a valid instruction, one that execute() knows */
+static char known(unsigned long op) {
+    unsigned char k = op & 0xF;
+    switch (op >> 16) {
+        case 0x2:  return k <= 0x3;
+        case 0x5:  return ((op >> 12) & 0xF) <= 0x3;
+        case 0x9:  return k <= 0x1;
+        case 0xF:  return (op & 0xFFF) != 0;
+        case 0x10: return k <= 0x9;
+        case 0x14: return k <= 0x1;
+        case 0x15: return (op & 0xFFFF) <= 0x1;
+        case 0x16: return ((op >> 8) & 0xF) <= 0x4;
+        case 0x18: return k <= 0x2;
+        case 0x19: return k <= 0x3;
+        case 0x1E: return k <= 0x3;
+        case 0x1F: return k <= 0x3;
+        case 0x20: return k <= 0x3;
+        case 0x21: return k <= 0x2;
+        case 0x22: return k <= 0x5;
+        case 0x23: return k <= 0x1;
+        case 0x24: return ((op >> 8) & 0xF) <= 0x1;
+        case 0x25: return !(op & 0xFF00);
+        case 0x27: return k <= 0x3;
+        case 0x28: return k <= 0x1;
+        default:   return (op >> 16) <= 0x28;
+    }
+}
@@ -0,0 +1,30 @@
+// P Disassembler - header file
+#define MEMSIZE 65535
+#define __PDIS_VERSION__ "0.1"
+
+typedef char FLAG;
+
+// a basic block: the instructions from start up to end
+typedef struct {
+    unsigned int start, end;
+    unsigned long long count;
+} Block;
+
+// the program, padded so that decoding near the end reads zeros
+unsigned char memory[MEMSIZE + 6] = {0};
+unsigned int  size = 0;
+
+// code[a] is set when an instruction reachable from address 0
+// begins at a, leader[a] when a basic block does, target[a] when
+// something jumps, calls or spawns to a and it needs a label
+unsigned char code[MEMSIZE] = {0};
+unsigned char leader[MEMSIZE] = {0};
+unsigned char target[MEMSIZE] = {0};
+// times each address ran, read from a `pvm -p' profile
+unsigned long long counts[MEMSIZE] = {0};
+FLAG profiled = 0;
+
+Block blocks[MEMSIZE / 3 + 1];
+unsigned int nblocks = 0;
+
+char* PROGNAME = "pdis";
@@ -1,18 +1,163 @@
 // P Virtual Machine - header file
 #define MEMSIZE 65535
+// fill/store reach up to 0xF cells past [X], which may be 0xFFFF
+#define MEMPAD 0x10
 #define REGISTERS 16
+#define STACKSIZE 0x100
+#define UNBOUNDED ((unsigned int)-1)
+#define XSLOTS 0x10
+// addresses from BANKBASE up read the selected window of the bank
+// backing, one byte per cell, windows are BANKSTRIDE bytes apart
+#define BANKBASE 0xC000
+#define BANKSTRIDE 0x4000
+#define ANONBANKS 0x10000
+// alloc hands out blocks from HEAPBASE, or the end of a program
+// loaded past it, up to the bank window, in power of two size
+// classes of 4 << c cells
+#define HEAPBASE 0x8000
+#define HEAPEND BANKBASE
+#define HEAPCLASSES 12
+#define HEAPBLOCKS ((HEAPEND - HEAPBASE) / 4)
+#define OUTSIZE 0x1000
+#define REGIONS 0x100
+#define HOSTCALLS 0x100
+#define THREADS 0x100
+// channels per direction per program, and cells in each ring
+#define CHANNELS 0x10
+#define CHANSIZE 0x4000
+#define STAGES 0x10
+#define PAGESIZE 0x100
+#define PAGES ((MEMSIZE + MEMPAD + PAGESIZE - 1) / PAGESIZE)
 #define DEBUG 0
 #define __PVM_VERSION__ "0.1"
 
-unsigned int  memory[MEMSIZE] = {0};
-unsigned int  reg[REGISTERS] = {0};
-unsigned char mode, halt, inst, x, y, k, psp=0;
-unsigned int  pc, mmmm, nnn, exit_code = EXIT_SUCCESS;
-unsigned long opcode;
+typedef char FLAG;
 
-unsigned int* X;
-unsigned int pc_stack[0xFF] = {0};
-unsigned int arrayX[0xF] = {0};
-char* PROGNAME = NULL;
+// state private to each guest thread, see spawn
+#define LOCAL static _Thread_local
 
-typedef char FLAG;
+// time and instructions spent between region.begin and region.end,
+// nested entries of the same region count once
+typedef struct {
+    unsigned long long start_ns, start_icount, ns, insts, hits;
+    unsigned int depth;
+} Region;
+
+typedef struct {
+    pthread_t id;
+    unsigned int exit_code;
+    FLAG used;
+} Thread;
+
+// a one way queue of messages between two programs, each message
+// its length followed by its cells; the sender only moves tail,
+// the receiver only head, so the two ends need no common lock;
+// threads of one program using the same end take turns by its own
+typedef struct {
+    unsigned int cells[CHANSIZE];
+    _Alignas(64) size_t head;
+    _Alignas(64) size_t tail;
+    FLAG done, gone;
+    pthread_mutex_t sending, receiving;
+} Channel;
+
+// a loaded program and what its threads share
+typedef struct {
+    unsigned int* memory;
+    unsigned char verified[MEMSIZE];
+    // set once a host function ran, which clears all of verified[]
+    FLAG hosted;
+    // allocator state, kept outside guest memory: the size class + 1
+    // of each allocated block, indexed by (address - HEAPBASE) / 4,
+    // free lists threaded through heapnext[], the bump pointer and
+    // where it starts
+    unsigned char heapclass[HEAPBLOCKS];
+    unsigned int  heapnext[HEAPBLOCKS];
+    unsigned int  freelist[HEAPCLASSES];
+    unsigned int  heaptop, heapbase;
+    // guest threads by id - 1; lock guards these and the heap
+    Thread threads[THREADS];
+    pthread_mutex_t lock;
+    unsigned char* bankmem;
+    size_t banklen;
+    // send #c writes out[c], recv #c reads in[c]
+    Channel* in[CHANNELS];
+    Channel* out[CHANNELS];
+    unsigned int nin, nout, exit_code;
+    // times each address was executed, with -p
+    unsigned long long* profile;
+    // what the region markers of its finished threads collected
+    Region regions[REGIONS];
+} Vm;
+
+#ifndef LIBPVM
+// the program as loaded, for reset
+static unsigned int  image[MEMSIZE + MEMPAD] = {0};
+#endif
+static unsigned char dirty[PAGES] = {0};
+static unsigned int  stacksize = STACKSIZE;
+
+// the program this thread runs, and its memory and verified[]
+LOCAL Vm* vm;
+LOCAL unsigned int* memory;
+LOCAL unsigned char* verified;
+LOCAL unsigned long long* profile;
+
+LOCAL unsigned int  reg[REGISTERS];
+LOCAL unsigned char halt, inst, x, y, k;
+LOCAL unsigned int  psp, dsp;
+LOCAL unsigned int  pc, mmmm, nnn, exit_code = EXIT_SUCCESS;
+// registers are 12 bits wide unless the program switches to wide mode
+LOCAL unsigned int  regmask = 0xFFF;
+LOCAL unsigned long opcode;
+// instructions executed so far
+LOCAL unsigned long long icount;
+// under --replay, the count the recorded run was interrupted at
+LOCAL unsigned long long stop_at = ~0ULL;
+
+LOCAL unsigned int* X;
+LOCAL unsigned int* pc_stack;
+LOCAL unsigned int* data_stack;
+LOCAL unsigned int* arrayX;
+LOCAL Region regions[REGIONS];
+
+// itoa and friends format into outbuf, written out by flush,
+// other output and when full
+LOCAL char  outbuf[OUTSIZE];
+LOCAL size_t outlen;
+LOCAL size_t winoff;
+LOCAL FLAG  banked, wide;
+
+static pvm_hostcall hostcalls[HOSTCALLS] = {NULL};
+static char* PROGNAME = "pvm";
+static char  record[MEMSIZE + 1] = {0};
+static size_t recordsize = 0;
+// --record appends each line read and the interrupt to recfile,
+// --replay reads them back from replay[]
+static FILE* recfile = NULL;
+static char* replay = NULL;
+static size_t replaylen = 0, replaypos = 0;
+
+static FLAG  rflag = 0, interrupted = 0, strict = 0;
+
+// mark the page holding address a as written, only needed by
+// --per-record mode; guest threads may mark pages at the same time
+#define DIRTY(a) do {                                               \
+        if (rflag) __atomic_store_n(&dirty[(a) / PAGESIZE], 1,      \
+                                    __ATOMIC_RELAXED);              \
+    } while (0)
+
+// take a fused compare-and-branch if c holds: the target is in the
+// 04mmmm word that follows it, which is stepped over otherwise
+#define BRANCH(c) (pc = (c) ? memory[pc + 1] << 8 | memory[pc + 2] \
+                            : pc + 3)
+
+// read or write guest address a, through the bank window if selected
+#define PEEK(a) (banked && (a) >= BANKBASE ? peek(a) : memory[a])
+#define POKE(a, v) do {                                     \
+        if (banked && (a) >= BANKBASE) poke((a), (v));      \
+        else { memory[a] = (v); DIRTY(a); unverify(a, 1); } \
+    } while (0)
+// whether verify() vouched for the instruction at a; any thread
+// may clear it by writing over the instruction, see unverify
+#define VERIFIED(a) __atomic_load_n(&verified[a], __ATOMIC_RELAXED)
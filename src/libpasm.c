@@ -0,0 +1,1378 @@
+#include <stdarg.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include "headers/pasm.h"
+
+static Form forms[] = {
+    {"halt",         "",    "",    0x000000, 0},
+    {"halt",         "#",   "4",   0x000000, 0},
+    {"load",         "Xa",  "-4",  0x030000, 0},
+    {"load",         "Xr",  "-x",  0x020003, 0},
+    {"load",         "r#",  "xW",  0x010000, 0},
+    {"load",         "rr",  "xy",  0x100004, 0},
+    {"load",         "rX",  "x-",  0x020002, 0},
+    {"fill",         "r@",  "xP",  0x020000, 0},
+    {"store",        "r@",  "xP",  0x020001, 0},
+    {"jump",         "a",   "4",   0x040000, 0},
+    {"jump",         "r",   "x",   0x1F0000, 0},
+    {"jump",         "Xr",  "-x",  0x1F0002, 0},
+    {"call",         "a",   "4",   0x110000, 0},
+    {"call",         "r",   "x",   0x1F0001, 0},
+    {"call",         "Xr",  "-x",  0x1F0003, 0},
+    {"ret",          "",    "",    0x120000, 0},
+    {"print0",       "",    "",    0x050000, 0},
+    {"print",        "#",   "3",   0x051000, 0},
+    {"putchar",      "#",   "2",   0x052000, 0},
+    {"printi",       "",    "",    0x053000, 0},
+    {"input",        "",    "",    0x060000, 0},
+    {"ifeq",         "r#",  "x3",  0x080000, 0x1A0000},
+    {"ifeq",         "rr",  "xy",  0x090001, 0x1E0000},
+    {"ifneq",        "r#",  "x3",  0x070000, 0x1B0000},
+    {"ifneq",        "rr",  "xy",  0x090000, 0x1E0001},
+    {"add",          "r#",  "x3",  0x0C0000, 0},
+    {"add",          "rr",  "xy",  0x100000, 0},
+    {"add",          "X#",  "-4",  0x0A0000, 0},
+    {"sub",          "r#",  "x3",  0x0D0000, 0},
+    {"sub",          "rr",  "xy",  0x100001, 0},
+    {"sub",          "X#",  "-4",  0x0B0000, 0},
+    {"mul",          "r#",  "x3",  0x0E0000, 0},
+    {"mul",          "rr",  "xy",  0x100002, 0},
+    {"div",          "r#",  "x3",  0x0F0000, 0},
+    {"div",          "rr",  "xy",  0x100003, 0},
+    {"switchx",      "#",   "k",   0x130000, 0},
+    {"bank",         "rr",  "xy",  0x140000, 0},
+    {"banks",        "rr",  "xy",  0x140001, 0},
+    {"shl",          "r#",  "x2",  0x160000, 0},
+    {"shl",          "rr",  "xy",  0x100005, 0},
+    {"shr",          "r#",  "x2",  0x160100, 0},
+    {"shr",          "rr",  "xy",  0x100006, 0},
+    {"and",          "r#",  "x2",  0x160200, 0},
+    {"and",          "rr",  "xy",  0x100007, 0},
+    {"or",           "r#",  "x2",  0x160300, 0},
+    {"or",           "rr",  "xy",  0x100008, 0},
+    {"xor",          "r#",  "x2",  0x160400, 0},
+    {"xor",          "rr",  "xy",  0x100009, 0},
+    {"mcopy",        "##r", "xyn", 0x180000, 0},
+    {"mset",         "#rr", "xyn", 0x180001, 0},
+    {"mcmp",         "##r", "xyn", 0x180002, 0},
+    {"strlen",       "r",   "x",   0x190000, 0},
+    {"memchr",       "rr",  "xy",  0x190001, 0},
+    {"strstr",       "r#",  "xy",  0x190002, 0},
+    {"crc32",        "rr",  "xy",  0x190003, 0},
+    {"jeq",          "r#a", "x3J", 0x1A0000, 0},
+    {"jeq",          "rra", "xyJ", 0x1E0000, 0},
+    {"jne",          "r#a", "x3J", 0x1B0000, 0},
+    {"jne",          "rra", "xyJ", 0x1E0001, 0},
+    {"jlt",          "r#a", "x3J", 0x1C0000, 0},
+    {"jlt",          "rra", "xyJ", 0x1E0002, 0},
+    {"jgt",          "r#a", "x3J", 0x1D0000, 0},
+    {"jgt",          "rra", "xyJ", 0x1E0003, 0},
+    {"push",         "r",   "x",   0x200000, 0},
+    {"pop",          "r",   "x",   0x200001, 0},
+    {"save",         "rr",  "xY",  0x200002, 0},
+    {"restore",      "rr",  "xY",  0x200003, 0},
+    {"alloc",        "r",   "x",   0x210000, 0},
+    {"free",         "",    "",    0x210001, 0},
+    {"freeall",      "",    "",    0x210002, 0},
+    {"atoi",         "r",   "x",   0x220000, 0},
+    {"atox",         "r",   "x",   0x220001, 0},
+    {"itoa",         "r",   "x",   0x220002, 0},
+    {"itox",         "r",   "x",   0x220003, 0},
+    {"itoan",        "r",   "x",   0x220004, 0},
+    {"flush",        "",    "",    0x220005, 0},
+    {"cycles",       "rr",  "xy",  0x230000, 0},
+    {"clock",        "rr",  "xy",  0x230001, 0},
+    {"region.begin", "#",   "2",   0x240000, 0},
+    {"region.end",   "#",   "2",   0x240100, 0},
+    {"hostcall",     "#",   "2",   0x250000, 0},
+    {"spawn",        "a",   "4",   0x260000, 0},
+    {"join",         "r",   "x",   0x270000, 0},
+    {"xadd",         "r",   "x",   0x270001, 0},
+    {"cas",          "rr",  "xy",  0x270002, 0},
+    {"fence",        "",    "",    0x270003, 0},
+    {"send",         "r#",  "xy",  0x280000, 0},
+    {"recv",         "r#",  "xy",  0x280001, 0},
+};
+
+#define FORMS (sizeof(forms) / sizeof(*forms))
+// mnemonics[h] is 1 + the index of the first form hashing to h,
+// seeded so that no two mnemonics share a slot; built by the
+// first assembly
+static unsigned char mnemonics[MNEMONICSLOTS];
+static unsigned long mnemonic_seed;
+static pthread_once_t mnemonics_once = PTHREAD_ONCE_INIT;
+
+/* Add an entry to a list of n diagnostics with room for size */
+static pasm_diag* new_diag(pasm_diag** list, size_t* n, size_t* size) {
+    if (*n == *size) {
+        *size = *size ? *size * 2 : 0x10;
+        *list = realloc(*list, *size * sizeof(**list));
+    }
+    return &(*list)[(*n)++];
+}
+
+/* Record an error at column col of the line being assembled and
+ * give up on the line, see pass */
+static _Noreturn void error(Pasm* as, unsigned int col, char* format, ...) {
+    pasm_diag* d = new_diag(&as->diags, &as->ndiags, &as->diagsize);
+    va_list args;
+
+    d->line = as->lex.line;
+    d->col = col;
+
+    va_start(args, format);
+    vsnprintf(d->message, sizeof(d->message), format, args);
+    va_end(args);
+    longjmp(as->bail, 1);
+}
+
+static _Noreturn void expected(Pasm* as, char* what, char* inst) {
+    error(as, as->lex.col, "EXPECTED %s AFTER `%s'", what, inst);
+}
+
+static _Noreturn void argument_size(Pasm* as, char* inst, char* size) {
+    error(as, as->lex.col, "`%s' ARGUMENT CANNOT BE GREATER THAN %s",
+          inst, size);
+}
+
+static _Noreturn void label_not_found(Pasm* as, Token label) {
+    error(as, label.col, "LABEL %.*s NOT FOUND",
+          (int)label.len, label.p);
+}
+
+static _Noreturn void inst_unknown(Pasm* as, Token inst) {
+    error(as, inst.col, "UNKNOWN INSTRUCTION: `%.*s'",
+          (int)inst.len, inst.p);
+}
+
+static _Noreturn void misplaced(Pasm* as, char* inst) {
+    error(as, as->lex.col, "`%s' MUST BE THE FIRST INSTRUCTION", inst);
+}
+
+static _Noreturn void unskippable(Pasm* as, Token inst) {
+    error(as, inst.col, "`%.*s' CANNOT FOLLOW `ifeq'/`ifneq'",
+          (int)inst.len, inst.p);
+}
+
+static _Noreturn void bad_number(Pasm* as, Token number) {
+    error(as, number.col, "BAD NUMBER: `%.*s'",
+          (int)number.len, number.p);
+}
+
+/* Go back to the start of the source */
+static void lex_start(Pasm* as) {
+    memset(&as->lex, 0, sizeof(as->lex));
+    as->lex.next = as->source;
+}
+
+/* Move on to the next line; return 0 at the end of the source */
+static char next_line(Pasm* as) {
+    Lexer* lex = &as->lex;
+    const char* end = as->source + as->sourcelen;
+    const char* c;
+
+    if (lex->next >= end) return 0;
+
+    lex->bol = lex->pos = lex->next;
+    c = memchr(lex->bol, '\n', end - lex->bol);
+    lex->eol = c ? c : end;
+    lex->next = c ? c + 1 : end;
+    // Strip the comment
+    c = memchr(lex->bol, ';', lex->eol - lex->bol);
+    if (c) lex->eol = c;
+
+    lex->line++;
+    lex->col = 1;
+    return 1;
+}
+
+#define SPACE(c) ((c) == ' ' || (c) == '\t' || (c) == '\r')
+
+/* Next token of the line, separated by blanks, and commas too if
+ * commas is set; it is empty at the end of the line */
+static Token token(Pasm* as, char commas) {
+    Lexer* lex = &as->lex;
+    Token t;
+
+    while (lex->pos < lex->eol &&
+            (SPACE(*lex->pos) || (commas && *lex->pos == ',')))
+        lex->pos++;
+    t.p = lex->pos;
+    while (lex->pos < lex->eol &&
+            !(SPACE(*lex->pos) || (commas && *lex->pos == ',')))
+        lex->pos++;
+
+    t.len = lex->pos - t.p;
+    t.col = lex->col = t.p - lex->bol + 1;
+    return t;
+}
+
+/* What is left of the line */
+static Token rest_of_line(Pasm* as) {
+    Lexer* lex = &as->lex;
+    Token t = {lex->pos, lex->eol - lex->pos, lex->pos - lex->bol + 1};
+    lex->pos = lex->eol;
+    return t;
+}
+
+/* Does token read s */
+static char is(Token t, char* s) {
+    return !strncmp(t.p, s, t.len) && !s[t.len];
+}
+
+/* The text between the first and last quote of t */
+static Token get_string(Token t) {
+    const char* first = memchr(t.p, '"', t.len);
+    const char* last = t.p + t.len;
+
+    while (first && --last > first && *last != '"');
+    if (!first || last == first) {
+        t.len = 0;
+        t.p = NULL;
+        return t;
+    }
+    t.col += first + 1 - t.p;
+    t.p = first + 1;
+    t.len = last - t.p;
+    return t;
+}
+
+/* FNV-1a */
+static unsigned long hash_name(const char* name, size_t len) {
+    unsigned long h = 2166136261u;
+    for (; len; name++, len--) {
+        h ^= (unsigned char)*name;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* Slot for the name of len bytes: the one holding it or
+ * the empty one where it would go */
+static Label* find_label(Pasm* as, const char* name, size_t len,
+                         unsigned long h) {
+    Label* labels = as->labels;
+    size_t i = h & (as->labelslots - 1);
+
+    for (;; i = (i + 1) & (as->labelslots - 1)) {
+        if (!labels[i].used) return &labels[i];
+        if (labels[i].hash == h &&
+                !strncmp(&as->names[labels[i].name], name, len) &&
+                !as->names[labels[i].name + len])
+            return &labels[i];
+    }
+}
+
+/* Double the table once it is half full */
+static void grow_labels(Pasm* as) {
+    Label* old = as->labels;
+    size_t i, slots = as->labelslots;
+    char* name;
+    Label* slot;
+
+    as->labelslots = slots ? slots * 2 : LABELSLOTS;
+    as->labels = calloc(as->labelslots, sizeof(*as->labels));
+    for (i=0; i<slots; i++) {
+        if (!old[i].used) continue;
+        name = &as->names[old[i].name];
+        slot = find_label(as, name, strlen(name), old[i].hash);
+        *slot = old[i];
+    }
+    free(old);
+}
+
+/* Slot of the name of len bytes, taking an empty one for it
+ * if the name is new */
+static Label* intern_label(Pasm* as, const char* name, size_t len) {
+    unsigned long h = hash_name(name, len);
+    Label* slot;
+
+    if (2 * (as->nlabels + 1) > as->labelslots) grow_labels(as);
+    slot = find_label(as, name, len, h);
+    if (slot->used) return slot;
+
+    if (as->nameslen + len + 1 > as->namessize) {
+        as->namessize = (as->nameslen + len + 1) * 2;
+        as->names = realloc(as->names, as->namessize);
+    }
+    memcpy(&as->names[as->nameslen], name, len);
+    as->names[as->nameslen + len] = '\0';
+
+    slot->used = 1;
+    slot->hash = h;
+    slot->name = as->nameslen;
+    as->nameslen += len + 1;
+    as->nlabels++;
+    return slot;
+}
+
+/* Define a label; the first definition of a name wins */
+static void add_label(Pasm* as, const char* name, size_t len,
+                      unsigned int address) {
+    Label* slot = intern_label(as, name, len);
+
+    if (slot->defined) return;
+    slot->defined = 1;
+    slot->address = address;
+}
+
+/* Value of the hex digits after the # or r of t */
+static unsigned int base16_decode(Pasm* as, Token t) {
+    unsigned int result = 0, digit;
+    size_t i;
+    char c;
+
+    if (t.len < 2) bad_number(as, t);
+    for (i=1; i<t.len; i++) {
+        c = t.p[i];
+        if (c >= '0' && c <= '9')
+            digit = c - '0';
+        else if (c >= 'a' && c <= 'f')
+            digit = c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F')
+            digit = c - 'A' + 10;
+        else
+            bad_number(as, t);
+        if (result >> 28) bad_number(as, t); // Doesn't fit 32 bits
+        result = result << 4 | digit;
+    }
+
+    return result;
+}
+
+/* Size of `load rx, #value': in wide mode every 12 bits
+ * past the first take another instruction
+ */
+static size_t const_size(unsigned int value) {
+    if (value <= 0xFFF) return 3;
+    if (value <= 0xFFFFFF) return 6;
+    return 9;
+}
+
+/* Make room for n more bytes of output */
+static void reserve(Pasm* as, size_t n) {
+    if (as->outlen + n <= as->outsize) return;
+    as->outsize = (as->outlen + n) * 2;
+    as->out = realloc(as->out, as->outsize);
+}
+
+static void set_word(Pasm* as, size_t at, unsigned long code) {
+    as->out[at] = code >> 16;
+    as->out[at + 1] = code >> 8 & 0xFF;
+    as->out[at + 2] = code & 0xFF;
+}
+
+static void put_word(Pasm* as, unsigned long code) {
+    reserve(as, 3);
+    set_word(as, as->outlen, code);
+    as->outlen += 3;
+}
+
+/* Emit rx = value, 12 bits at a time */
+static void put_const(Pasm* as, unsigned char x, unsigned int value) {
+    int shift = (const_size(value) / 3 - 1) * 12;
+    unsigned int chunk = (value >> shift) & 0xFFF;
+
+    put_word(as, 0x010000 | x << 12 | chunk);
+    for (shift -= 12; shift >= 0; shift -= 12) {
+        chunk = (value >> shift) & 0xFFF;
+        put_word(as, 0x170000 | x << 12 | chunk);
+    }
+}
+
+/* Slot of the mnemonic hash for the name of len bytes */
+static size_t mnemonic_slot(const char* name, size_t len, unsigned long seed) {
+    return (hash_name(name, len) * seed >> 32) & (MNEMONICSLOTS - 1);
+}
+
+/* Find a seed under which every mnemonic gets a slot of its own */
+static void build_mnemonics(void) {
+    size_t i, h;
+
+    for (mnemonic_seed=1;; mnemonic_seed += 2) {
+        memset(mnemonics, 0, sizeof(mnemonics));
+        for (i=0; i<FORMS; i++) {
+            if (i && !strcmp(forms[i].name, forms[i - 1].name))
+                continue;
+            h = mnemonic_slot(forms[i].name, strlen(forms[i].name),
+                              mnemonic_seed);
+            if (mnemonics[h]) break;
+            mnemonics[h] = i + 1;
+        }
+        if (i == FORMS) return;
+    }
+}
+
+/* First form of mnemonic name, NULL if there is none */
+static Form* find_form(Token name) {
+    unsigned char i = mnemonics[mnemonic_slot(name.p, name.len,
+                                              mnemonic_seed)];
+    return i && is(name, forms[i - 1].name) ? &forms[i - 1] : NULL;
+}
+
+/* What an operand of kind k looks like, for error messages */
+static char* kind_name(char k) {
+    switch (k) {
+        case 'r': return "rx";
+        case '#': return "#NUM";
+        case 'a': return "#ADDR OR @LABEL";
+        case '@': return "@LABEL";
+        case 'X': return "[X]";
+        default:  return "NOTHING";
+    }
+}
+
+/* Does token fit an operand of kind k */
+static char kind_fits(char k, Token t) {
+    if (!t.len) return 0;
+    switch (k) {
+        case 'r': return *t.p == 'r';
+        case '#': return *t.p == '#';
+        case 'a': return *t.p == '#' || *t.p == '@';
+        case '@': return *t.p == '@';
+        case 'X': return is(t, "[X]");
+        default:  return 0;
+    }
+}
+
+/* How many of the n operands fit form f, n + 1 if they all do */
+static size_t form_fits(Form* f, Token ops[], size_t n) {
+    size_t i;
+    for (i=0; i<n && f->kinds[i]; i++)
+        if (!kind_fits(f->kinds[i], ops[i])) return i;
+    return i == n && !f->kinds[i] ? n + 1 : i;
+}
+
+/* Value of an operand: a register or number, or the address of
+ * a label; one not defined yet reads 0 and gets a fixup for
+ * the 16 bits at out[at], in instruction inst */
+static unsigned int operand(Pasm* as, Token t, size_t at, char* inst) {
+    Label* slot;
+    Fixup* fix;
+
+    if (*t.p != '@') return base16_decode(as, t);
+    slot = intern_label(as, t.p + 1, t.len - 1); // Skip @
+    if (slot->defined && !as->defer) return slot->address;
+
+    if (as->nfixups == as->fixupsize) {
+        as->fixupsize = as->fixupsize ? as->fixupsize * 2 : 0x100;
+        as->fixups = realloc(as->fixups,
+                             as->fixupsize * sizeof(*as->fixups));
+    }
+    fix = &as->fixups[as->nfixups++];
+    fix->at = at;
+    fix->name = slot->name;
+    fix->hash = slot->hash;
+    fix->line = as->lex.line;
+    fix->col = t.col;
+    fix->inst = inst;
+    return 0;
+}
+
+/* Check value fits a field of the given mask, name the limit
+ * the way the operand is written */
+static void check_field(Pasm* as, char* name, char kind, unsigned int value,
+                        unsigned int mask) {
+    char limit[12];
+
+    if (value <= mask) return;
+    sprintf(limit, "%s%X", kind == 'r' ? "r#" : "#", mask);
+    argument_size(as, name, limit);
+}
+
+/* Note that inst uses a fixed address at t, which keeps -O from
+ * moving code unless the address, at, is past the program */
+static void fixed_address(Pasm* as, Token t, char* inst, unsigned int at) {
+    if (at >= as->fixedat) return;
+    as->fixedat = at;
+    as->fixed.line = as->lex.line;
+    as->fixed.col = t.col;
+    snprintf(as->fixed.message, sizeof(as->fixed.message),
+             "NOT OPTIMIZING, `%s' USES A FIXED ADDRESS", inst);
+}
+
+/* Assemble the instruction `mnemonic' through its forms and
+ * return its size; fuse is where an `ifeq'/`ifneq' right before
+ * it went, if one did */
+static size_t instruction(Pasm* as, Token mnemonic, size_t fuse) {
+    Form* f = find_form(mnemonic);
+    Form* best;
+    Token ops[4];
+    char* name;
+    size_t count, i, fit, most = 0, at, word;
+    unsigned long code = 0, before = 0, after = 0;
+    unsigned int value = 0, x = 0;
+    size_t size = 3;
+    char constant = 0;
+
+    if (!f) inst_unknown(as, mnemonic);
+    name = f->name;
+
+    for (count=0; count<4 && (ops[count] = token(as, 1)).len; count++);
+
+    // the first form that fits, or the one that fits furthest
+    for (best=f; f<&forms[FORMS] && !strcmp(f->name, name); f++) {
+        fit = form_fits(f, ops, count);
+        if (fit == count + 1) break;
+        if (fit > most) {
+            most = fit;
+            best = f;
+        }
+    }
+    if (f == &forms[FORMS] || strcmp(f->name, name)) {
+        as->lex.col = most < count ? ops[most].col : as->lex.col;
+        expected(as, kind_name(best->kinds[most]), name);
+    }
+
+    // where the instruction word goes, and so any label in it
+    word = as->outlen + (strchr(f->fields, 'P') ? 3 : 0);
+    for (i=0; f->kinds[i]; i++) {
+        if (f->kinds[i] == 'X') continue;
+        at = f->fields[i] == 'P' ? as->outlen + 1 :
+             f->fields[i] == 'J' ? word + 4 : word + 1;
+        value = operand(as, ops[i], at, name);
+        as->lex.col = ops[i].col;
+        if (f->kinds[i] == 'a' && *ops[i].p == '#')
+            fixed_address(as, ops[i], name,
+                          f->code == 0x030000 ? value : 0);
+        switch (f->fields[i]) {
+            case 'x':
+                check_field(as, name, f->kinds[i], value, 0xF);
+                code |= value << 12;
+                x = value;
+                break;
+            case 'Y':
+                if (value < x)
+                    expected(as, "ry >= rx", name);
+                // fall through
+            case 'y':
+                check_field(as, name, f->kinds[i], value, 0xF);
+                code |= value << 8;
+                break;
+            case 'n':
+                check_field(as, name, f->kinds[i], value, 0xF);
+                code |= value << 4;
+                break;
+            case 'k':
+                check_field(as, name, f->kinds[i], value, 0xF);
+                code |= value;
+                break;
+            case '2':
+                check_field(as, name, f->kinds[i], value, 0xFF);
+                code |= value;
+                break;
+            case '3':
+                check_field(as, name, f->kinds[i], value, 0xFFF);
+                code |= value;
+                break;
+            case '4':
+                check_field(as, name, f->kinds[i], value, 0xFFFF);
+                code |= value;
+                break;
+            case 'P':
+                check_field(as, name, f->kinds[i], value, 0xFFFF);
+                before = 0x030000 | value;
+                size += 3;
+                break;
+            case 'J':
+                check_field(as, name, f->kinds[i], value, 0xFFFF);
+                after = 0x040000 | value;
+                size += 3;
+                break;
+            case 'W':
+                if (!as->wide)
+                    check_field(as, name, f->kinds[i], value, 0xFFF);
+                size = const_size(value);
+                constant = 1;
+                break;
+        }
+    }
+    // jump or call rx: an address computed from numbers
+    if (f->code == 0x1F0000 || f->code == 0x1F0001)
+        fixed_address(as, mnemonic, name, 0);
+    // a skip steps over the first word only, the rest would run:
+    // the target of a branch, the words after `load rx, #NUM'
+    if (fuse != NOFUSE &&
+            (strchr(f->fields, 'J') || (constant && size > 3))) {
+        if (fuse != LEAD) unskippable(as, mnemonic);
+        as->lead_long = 1;
+    }
+
+    if (before) put_word(as, before);
+    if (constant)
+        put_const(as, x, value);
+    else {
+        // a jump to a fixed address turns the `ifeq'/`ifneq' before
+        // it into a compare-and-branch, which reuses it as its target
+        if (fuse != NOFUSE && f->kinds[0] == 'a' && !strcmp(name, "jump")) {
+            if (fuse == LEAD)
+                as->lead_jump = 1;
+            else
+                set_word(as, fuse, as->fuse_word);
+        }
+        if (f->fused) {
+            as->fuse_at = as->outlen;
+            as->fuse_word = f->fused | (code & 0xFFFF);
+        }
+        put_word(as, f->code | code);
+    }
+    if (after) put_word(as, after);
+
+    as->form = f;
+    return size;
+}
+
+/* Assemble a data directive or `wide'; return its size,
+ * or -1 if name isn't one */
+static long directive(Pasm* as, Token name) {
+    Token t;
+    char* string = is(name, "string")  ? "string"  :
+                   is(name, "stringn") ? "stringn" :
+                   is(name, "stringl") ? "stringl" : NULL;
+    unsigned int value;
+    long size;
+
+    if (string) {
+        // a series of bytes, ended with \0, nothing, or \n\0
+        t = get_string(rest_of_line(as));
+        if (!t.p)
+            expected(as, "\"...\"", string);
+
+        size = t.len;
+        reserve(as, t.len + 2);
+        memcpy(&as->out[as->outlen], t.p, t.len);
+        as->outlen += t.len;
+
+        if (string[6] == 'l') {
+            as->out[as->outlen++] = '\n';
+            size++;
+        }
+        if (string[6] != 'n') {
+            as->out[as->outlen++] = '\0';
+            size++;
+        }
+        return size;
+    }
+
+    if (is(name, "char")) {
+        t = token(as, 0);
+        if (!t.len || *t.p != '#')
+            expected(as, "#NUM", "char");
+
+        value = base16_decode(as, t);
+        check_field(as, "char", '#', value, 0xFF);
+        reserve(as, 1);
+        as->out[as->outlen++] = value;
+        return 1;
+    }
+
+    if (is(name, "jumptable")) {
+        // addresses two bytes each, high first
+        t = token(as, 1);
+        if (!t.len)
+            expected(as, "@LABEL OR #ADDR", "jumptable");
+
+        for (size=0; t.len; t = token(as, 1), size += 2) {
+            if (!kind_fits('a', t))
+                expected(as, "@LABEL OR #ADDR", "jumptable");
+
+            value = operand(as, t, as->outlen, "jumptable");
+            as->lex.col = t.col;
+            if (*t.p == '#') fixed_address(as, t, "jumptable", 0);
+            check_field(as, "jumptable", '#', value, 0xFFFF);
+            reserve(as, 2);
+            as->out[as->outlen++] = value >> 8;
+            as->out[as->outlen++] = value & 0xFF;
+        }
+        return size;
+    }
+
+    if (is(name, "wide")) {
+        if (token(as, 0).len)
+            expected(as, "NOTHING", "wide");
+        if (as->outlen || as->tail) {
+            as->lex.col = name.col;
+            misplaced(as, "wide");
+        }
+
+        as->wide = 1;
+        put_word(as, 0x150001);
+        return 3;
+    }
+
+    return -1;
+}
+
+/* Keep the line just assembled for -O */
+static void add_item(Pasm* as, size_t at, size_t fix, char skipped) {
+    Item* item;
+
+    if (as->nitems == as->itemsize) {
+        as->itemsize = as->itemsize ? as->itemsize * 2 : 0x100;
+        as->items = realloc(as->items, as->itemsize * sizeof(*as->items));
+    }
+    item = &as->items[as->nitems++];
+    item->at = at;
+    item->size = as->outlen - at;
+    item->fix = fix;
+    item->nfix = as->nfixups - fix;
+    item->form = as->form;
+    item->inlined = 0;
+    item->skipped = skipped;
+    item->dead = 0;
+}
+
+/* Assemble the line from token t on, return its size */
+static size_t assemble(Pasm* as, Token t) {
+    size_t fuse = as->fuse_at, at = as->outlen, fix = as->nfixups;
+    long size;
+
+    as->fuse_at = NOFUSE;
+    as->form = NULL;
+    size = directive(as, t);
+    if (size == -1) size = instruction(as, t, fuse);
+    // fuse is only set right after an `ifeq'/`ifneq'
+    if (as->optimize) add_item(as, at, fix, fuse != NOFUSE);
+    return size;
+}
+
+/* Define the label of the current line if it has one,
+ * then assemble the rest */
+static void assemble_line(Pasm* as) {
+    Token t = token(as, 0);
+
+    if (t.len && t.p[t.len - 1] == ':') {
+        // Label
+        add_label(as, t.p, t.len - 1, as->outlen);
+        t = token(as, 0);
+    }
+    if (t.len) assemble(as, t);
+}
+
+/* Read the source line by line, defining labels as they come
+ * and assembling into out[]; an error gives up on its line,
+ * so each one with an error gets a diagnostic
+ */
+static void pass(Pasm* as) {
+    for (lex_start(as); next_line(as);)
+        if (setjmp(as->bail))
+            as->fuse_at = NOFUSE;
+        else
+            assemble_line(as);
+}
+
+/* Fill in a label that was used before it was defined */
+static void patch(Pasm* as, Fixup* fix) {
+    Label* slot;
+    Token name;
+
+    name.p = &as->names[fix->name];
+    name.len = strlen(name.p);
+    name.col = as->lex.col = fix->col;
+    as->lex.line = fix->line;
+
+    slot = find_label(as, name.p, name.len, fix->hash);
+    if (!slot->defined) label_not_found(as, name);
+    check_field(as, fix->inst, '#', slot->address, 0xFFFF);
+    as->out[fix->at] = slot->address >> 8;
+    as->out[fix->at + 1] = slot->address & 0xFF;
+}
+
+/* -O, the peephole optimizer: with every label left to a fixup
+ * and each line kept in items[], it drops and rewrites whole lines,
+ * inlines small subroutines, and lays the program out again. It
+ * leaves alone what comes right after an `ifeq'/`ifneq', as that
+ * may be skipped, and doesn't run at all on programs that use
+ * fixed addresses into themselves */
+
+/* Index of the first item at or after address at */
+static size_t item_at(Pasm* as, size_t at) {
+    size_t lo = 0, hi = as->nitems, mid;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (as->items[mid].at < at) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/* The first item from i on that is still in the program */
+static size_t live(Pasm* as, size_t i) {
+    while (i < as->nitems && as->items[i].dead) i++;
+    return i;
+}
+
+static Label* fixup_label(Pasm* as, Fixup* fix) {
+    char* name = &as->names[fix->name];
+    return find_label(as, name, strlen(name), fix->hash);
+}
+
+/* The item the label of fix is at, nitems if it is at the end */
+static size_t fixup_target(Pasm* as, Fixup* fix) {
+    return item_at(as, fixup_label(as, fix)->address);
+}
+
+/* Is item a `jump @label' */
+static char is_jump(Item* item) {
+    return item->form && item->form->code == 0x040000 && item->nfix;
+}
+
+/* Does fix give an address that is run, rather than read */
+static char is_code(Fixup* fix) {
+    return strcmp(fix->inst, "load") && strcmp(fix->inst, "fill") &&
+           strcmp(fix->inst, "store");
+}
+
+/* Point jumps, calls and branches to a `jump @label' at where
+ * that jump goes, hop after hop */
+static void shorten_chains(Pasm* as) {
+    Fixup *fix, *next;
+    size_t t, hops;
+
+    for (fix=as->fixups; fix<&as->fixups[as->nfixups]; fix++) {
+        if (!is_code(fix)) continue;
+        // a loop of jumps only goes around so many times
+        for (hops=0; hops<as->nitems; hops++) {
+            t = fixup_target(as, fix);
+            if (t == as->nitems || !is_jump(&as->items[t])) break;
+            next = &as->fixups[as->items[t].fix];
+            if (next == fix) break;
+            fix->name = next->name;
+            fix->hash = next->hash;
+        }
+    }
+}
+
+/* Is item `add'/`sub' of a number; what it changes is set to x
+ * for register x or -1 for [X], by to how much */
+static char is_step(Pasm* as, Item* item, int* what, long* by) {
+    unsigned char* p = &as->out[item->at];
+
+    if (!item->form) return 0;
+    switch (item->form->code) {
+        case 0x0A0000: case 0x0B0000:
+            *what = -1;
+            *by = p[1] << 8 | p[2];
+            break;
+        case 0x0C0000: case 0x0D0000:
+            *what = p[1] >> 4;
+            *by = (p[1] & 0xF) << 8 | p[2];
+            break;
+        default:
+            return 0;
+    }
+    if (item->form->code & 0x010000) *by = -*by; // sub
+    return 1;
+}
+
+/* Fold runs of `add'/`sub' of numbers to the same [X] or register
+ * into one, or none if they cancel out; [X] wraps at 16 bits, so
+ * any sum will do for it, a register sum must fit 12 bits */
+static void merge_steps(Pasm* as, char* labelled) {
+    Item* item;
+    size_t i, j;
+    int what, other;
+    long by, more;
+
+    for (i=0; i<as->nitems; i++) {
+        item = &as->items[i];
+        if (item->dead || item->skipped ||
+                !is_step(as, item, &what, &by))
+            continue;
+
+        for (j=live(as, i + 1); j<as->nitems && !labelled[j];
+                j=live(as, j + 1)) {
+            if (!is_step(as, &as->items[j], &other, &more) ||
+                    other != what)
+                break;
+            if (what != -1 && (by + more > 0xFFF || by + more < -0xFFF))
+                break;
+            by += more;
+            as->items[j].dead = 1;
+        }
+
+        if (what == -1) {
+            by &= 0xFFFF;
+            set_word(as, item->at, 0x0A0000 | by);
+        } else if (by >= 0)
+            set_word(as, item->at, 0x0C0000 | what << 12 | by);
+        else
+            set_word(as, item->at, 0x0D0000 | what << 12 | -by);
+        item->dead = !by;
+    }
+}
+
+/* Does an instruction with opcode op leave [X] as it is */
+static char keeps_x(unsigned char op) {
+    switch (op) {
+        case 0x01: case 0x02: case 0x05: case 0x06: case 0x07:
+        case 0x08: case 0x09: case 0x0C: case 0x0D: case 0x0E:
+        case 0x0F: case 0x10: case 0x14: case 0x15: case 0x16:
+        case 0x17: case 0x18: case 0x19: case 0x20: case 0x23:
+        case 0x24:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+/* Drop each `load [X]' of what [X] already holds, as far as
+ * a straight run of lines without labels tells; a label on a line
+ * dropped already still ends the run, as it moves to the next one */
+static void drop_loads(Pasm* as, char* labelled) {
+    Item* item;
+    size_t i;
+    // what [X] holds: a number, or a label by the offset of its name
+    char known = 0, label = 0, is_label;
+    unsigned long value = 0, loads;
+
+    for (i=0; i<as->nitems; i++) {
+        item = &as->items[i];
+        if (labelled[i]) known = 0;
+        if (item->dead) continue;
+        if (!item->form) {
+            known = 0;
+            continue;
+        }
+        if (item->form->code != 0x030000 && !strchr(item->form->fields, 'P')) {
+            if (!keeps_x(item->form->code >> 16)) known = 0;
+            continue;
+        }
+
+        // `load [X], ...', or a `fill'/`store' that starts with one
+        is_label = item->nfix && as->fixups[item->fix].at == item->at + 1;
+        loads = is_label ? as->fixups[item->fix].name
+                         : (unsigned long)as->out[item->at + 1] << 8 |
+                           as->out[item->at + 2];
+        if (item->form->code == 0x030000 && !item->skipped && known &&
+                is_label == label && loads == value) {
+            item->dead = 1;
+            continue;
+        }
+        known = !item->skipped;
+        label = is_label;
+        value = loads;
+    }
+}
+
+/* Drop jumps to the line right after them, until there are none */
+static void drop_jumps(Pasm* as) {
+    Item* item;
+    size_t i;
+    char again = 1;
+
+    while (again) {
+        again = 0;
+        for (i=0; i<as->nitems; i++) {
+            item = &as->items[i];
+            if (item->dead || item->skipped || !is_jump(item)) continue;
+            if (live(as, fixup_target(as, &as->fixups[item->fix])) ==
+                    live(as, i + 1)) {
+                item->dead = 1;
+                again = 1;
+            }
+        }
+    }
+}
+
+/* If a call to the subroutine at item s may be replaced with its
+ * lines up to the `ret', return the size of those, else -1: it must
+ * not branch, call, or be jumped into past its start, its code must
+ * not be read as data, and it must be small */
+static long leaf_size(Pasm* as, size_t s, char* labelled) {
+    Item* item;
+    Fixup* fix;
+    size_t i;
+    long size = 0;
+
+    for (fix=as->fixups; fix<&as->fixups[as->nfixups]; fix++)
+        if (!is_code(fix) && fixup_target(as, fix) == s) return -1;
+
+    for (i=s; i<as->nitems; i++) {
+        item = &as->items[i];
+        if (i > s && labelled[i]) return -1;
+        if (item->dead) continue;
+        if (!item->form) return -1;
+        switch (item->form->code >> 16) {
+            case 0x12:
+                return size;
+            case 0x04: case 0x07: case 0x08: case 0x09: case 0x11:
+            case 0x1A: case 0x1B: case 0x1C: case 0x1D: case 0x1E:
+            case 0x1F: case 0x26:
+                return -1;
+        }
+        for (fix=&as->fixups[item->fix];
+                fix<&as->fixups[item->fix + item->nfix]; fix++)
+            if (is_code(fix)) return -1;
+        size += item->size;
+        if (size > INLINESIZE) return -1;
+    }
+    return -1;
+}
+
+/* Inline the calls to small subroutines, first come first served,
+ * while the program grows by no more than as->inline_size, noting
+ * each one; it must not grow over a fixed address past its end */
+static void inline_calls(Pasm* as, char* labelled) {
+    // the leaf_size of each subroutine called, -2 until known
+    long* sizes = malloc(as->nitems * sizeof(*sizes));
+    long room = as->inline_size, grow, total = as->outlen;
+    long limit = as->fixedat < 0xFFFF ? as->fixedat : 0xFFFF;
+    pasm_diag* note;
+    Fixup* fix;
+    Item* item;
+    size_t i, s;
+
+    for (i=0; i<as->nitems; i++) sizes[i] = -2;
+    for (i=0; i<as->nitems; i++) {
+        item = &as->items[i];
+        // the lines of a subroutine can't stand in for a call
+        // that may be skipped
+        if (item->dead || item->skipped || !item->form ||
+                item->form->code != 0x110000 || !item->nfix)
+            continue;
+        fix = &as->fixups[item->fix];
+        s = fixup_target(as, fix);
+        if (s == as->nitems) continue;
+        if (sizes[s] == -2) sizes[s] = leaf_size(as, s, labelled);
+        if (sizes[s] < 0) continue;
+
+        grow = sizes[s] - (long)item->size;
+        if (grow > room || total + grow > limit) continue;
+        room -= grow;
+        total += grow;
+        item->inlined = s + 1;
+
+        note = new_diag(&as->notes, &as->nnotes, &as->notesize);
+        note->line = fix->line;
+        note->col = fix->col;
+        snprintf(note->message, sizeof(note->message),
+                 "INLINED CALL TO `%s'", &as->names[fix->name]);
+    }
+    free(sizes);
+}
+
+/* Copy item to out at len, with its labels patched in */
+static size_t place_item(Pasm* as, Item* item, unsigned char* out,
+                         size_t len) {
+    Label* label;
+    Fixup* fix;
+    size_t pos;
+
+    memcpy(&out[len], &as->out[item->at], item->size);
+    for (fix=&as->fixups[item->fix];
+            fix<&as->fixups[item->fix + item->nfix]; fix++) {
+        pos = len + fix->at - item->at;
+        label = fixup_label(as, fix);
+        out[pos] = label->address >> 8;
+        out[pos + 1] = label->address & 0xFF;
+    }
+    return item->size;
+}
+
+/* Place item i at len in out, or the lines of the subroutine
+ * in its stead if it is an inlined call; return their size.
+ * Only measure if out is NULL */
+static size_t place(Pasm* as, size_t i, unsigned char* out, size_t len) {
+    Item* item = &as->items[i];
+    size_t start = len;
+
+    if (item->dead) return 0;
+    if (!item->inlined)
+        return out ? place_item(as, item, out, len) : item->size;
+
+    for (i=item->inlined - 1; as->items[i].form->code != 0x120000; i++) {
+        item = &as->items[i];
+        if (item->dead) continue;
+        len += out ? place_item(as, item, out, len) : item->size;
+    }
+    return len - start;
+}
+
+/* Lay out the lines left, inlined calls as their subroutines, move
+ * each label to where the first line from its own on went, and patch
+ * in the new addresses */
+static void relayout(Pasm* as) {
+    size_t* at = malloc((as->nitems + 1) * sizeof(*at));
+    unsigned char* out;
+    size_t i, len = 0;
+    Label* label;
+
+    for (i=0; i<as->nitems; i++) {
+        at[i] = len;
+        len += place(as, i, NULL, len);
+    }
+    at[as->nitems] = len;
+
+    for (label=as->labels; label<&as->labels[as->labelslots]; label++)
+        if (label->defined)
+            label->address = at[item_at(as, label->address)];
+
+    out = malloc(len ? len : 1);
+    for (i=0; i<as->nitems; i++)
+        place(as, i, out, at[i]);
+
+    free(as->out);
+    free(at);
+    as->out = out;
+    as->outlen = as->outsize = len;
+}
+
+static void optimize(Pasm* as) {
+    Label* label;
+    char* labelled;
+
+    if (as->fixedat < as->outlen) {
+        *new_diag(&as->notes, &as->nnotes, &as->notesize) = as->fixed;
+        return;
+    }
+
+    // lines jumped to, or read, from elsewhere
+    labelled = calloc(as->nitems + 1, 1);
+    for (label=as->labels; label<&as->labels[as->labelslots]; label++)
+        if (label->defined)
+            labelled[item_at(as, label->address)] = 1;
+
+    shorten_chains(as);
+    merge_steps(as, labelled);
+    drop_loads(as, labelled);
+    drop_jumps(as);
+    if (as->inline_size) inline_calls(as, labelled);
+    relayout(as);
+    free(labelled);
+}
+
+static Pasm* new_pasm(const char* source, size_t len) {
+    // on the heap, so that it holds still across the longjmps
+    Pasm* as = calloc(1, sizeof(*as));
+
+    as->source = source;
+    as->sourcelen = len;
+    as->fuse_at = NOFUSE;
+    as->fixedat = ~0u;
+    return as;
+}
+
+static void free_pasm(Pasm* as) {
+    free(as->labels);
+    free(as->names);
+    free(as->fixups);
+    free(as->out);
+    free(as->diags);
+    free(as->notes);
+    free(as->items);
+    free(as);
+}
+
+/* Assemble all of as->source and patch its fixups */
+static void assemble_all(Pasm* as) {
+    size_t i;
+
+    pass(as);
+    for (i=0; i<as->nfixups; i++)
+        if (!setjmp(as->bail)) patch(as, &as->fixups[i]);
+    if (as->optimize && !as->ndiags) optimize(as);
+}
+
+/* Hand the image or the diagnostics of as over to result */
+static char finish(Pasm* as, pasm_result* result) {
+    result->diags = as->diags;
+    result->ndiags = as->ndiags;
+    result->notes = as->notes;
+    result->nnotes = as->nnotes;
+    as->notes = NULL;
+    result->image = as->ndiags ? NULL : as->out;
+    result->size = as->ndiags ? 0 : as->outlen;
+    as->diags = NULL;
+    if (!as->ndiags) as->out = NULL;
+
+    free_pasm(as);
+    return result->ndiags != 0;
+}
+
+/* Does the source start with `wide', as its first instruction */
+static char starts_wide(const char* source, size_t len) {
+    Pasm* as = new_pasm(source, len);
+    Token t = {NULL, 0, 0};
+    char wide;
+
+    for (lex_start(as); next_line(as);) {
+        t = token(as, 0);
+        if (t.len && t.p[t.len - 1] == ':') t = token(as, 0);
+        if (t.len) break;
+    }
+    wide = t.len && is(t, "wide");
+    free_pasm(as);
+    return wide;
+}
+
+/* First round: assemble a chunk into its own buffer, at addresses
+ * from 0, with all its labels left to fixups */
+static void encode_chunk(Pool* pool, Chunk* c) {
+    c->as = new_pasm(c->source, c->len);
+    c->as->defer = 1;
+    c->as->tail = c != pool->chunks;
+    c->as->wide = pool->all->wide;
+    c->as->fuse_at = LEAD;
+    pass(c->as);
+    c->failed = c->as->ndiags != 0;
+}
+
+/* Second round: copy a chunk into its place in the image, and
+ * patch in the addresses of the labels it uses */
+static void place_chunk(Pool* pool, Chunk* c) {
+    Pasm* all = pool->all;
+    Pasm* as = c->as;
+    Fixup* fix;
+    Label* slot;
+    char* name;
+    size_t at;
+
+    if (as->outlen) memcpy(&all->out[c->base], as->out, as->outlen);
+    for (fix=as->fixups; fix<&as->fixups[as->nfixups]; fix++) {
+        name = &as->names[fix->name];
+        slot = find_label(all, name, strlen(name), fix->hash);
+        if (!slot->defined || slot->address > 0xFFFF) {
+            // reported by the serial assembly
+            c->failed = 1;
+            return;
+        }
+        at = c->base + fix->at;
+        all->out[at] = slot->address >> 8;
+        all->out[at + 1] = slot->address & 0xFF;
+    }
+}
+
+/* Take chunks off the pool until there are none left */
+static void* pool_thread(void* arg) {
+    Pool* pool = arg;
+    size_t i;
+
+    while ((i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED))
+            < pool->nchunks)
+        pool->work(pool, &pool->chunks[i]);
+    return NULL;
+}
+
+/* Run work over the chunks of the pool on jobs threads,
+ * this one included */
+static void run_pool(Pool* pool, void (*work)(Pool*, Chunk*),
+                     unsigned int jobs) {
+    pthread_t threads[jobs];
+    unsigned int i;
+
+    pool->work = work;
+    pool->next = 0;
+    for (i=1; i<jobs; i++)
+        pthread_create(&threads[i], NULL, pool_thread, pool);
+    pool_thread(pool);
+    for (i=1; i<jobs; i++)
+        pthread_join(threads[i], NULL);
+}
+
+/* Assemble as->source in chunks of whole lines on jobs threads:
+ * each chunk is assembled on its own, a prefix sum over their
+ * sizes places them, their labels are merged in source order
+ * so the first definition still wins, then the chunks are copied
+ * into the image with their fixups patched. An `ifeq'/`ifneq'
+ * ending a chunk is fused with a jump starting the next here.
+ * Return 0 if anything went wrong, for assemble_all to report */
+static char assemble_chunks(Pasm* as, unsigned int jobs, size_t nchunks) {
+    Pool pool = {as, calloc(nchunks, sizeof(Chunk)), nchunks, 0, NULL};
+    const char* end = as->source + as->sourcelen;
+    const char* from = as->source;
+    const char *to, *nl;
+    size_t i, pending = NOFUSE;
+    unsigned long word = 0;
+    Label* label;
+    Pasm* c;
+    char ok = 1;
+
+    // split at the first line break past each even share
+    for (i=0; i<nchunks; i++) {
+        to = i < nchunks - 1 ? as->source + as->sourcelen / nchunks * (i + 1)
+                             : end;
+        if (to < from) to = from;
+        to = to < end && (nl = memchr(to, '\n', end - to)) ? nl + 1 : end;
+        pool.chunks[i].source = from;
+        pool.chunks[i].len = to - from;
+        from = to;
+    }
+
+    as->wide = starts_wide(as->source, as->sourcelen);
+    run_pool(&pool, encode_chunk, jobs);
+
+    for (i=0; i<nchunks && ok; i++) {
+        c = pool.chunks[i].as;
+        ok = !pool.chunks[i].failed;
+        pool.chunks[i].base = as->outlen;
+        for (label=c->labels; label<&c->labels[c->labelslots]; label++)
+            if (label->defined)
+                add_label(as, &c->names[label->name],
+                          strlen(&c->names[label->name]),
+                          as->outlen + label->address);
+        as->outlen += c->outlen;
+    }
+
+    if (ok) {
+        as->out = malloc(as->outlen ? as->outlen : 1);
+        run_pool(&pool, place_chunk, jobs);
+    }
+
+    for (i=0; i<nchunks; i++) {
+        c = pool.chunks[i].as;
+        ok = ok && !pool.chunks[i].failed;
+        if (ok && c->fuse_at != LEAD) {
+            // the chunk assembled something
+            if (pending != NOFUSE && c->lead_jump)
+                set_word(as, pending, word);
+            // the serial assembly reports it
+            if (pending != NOFUSE && c->lead_long) ok = 0;
+            pending = c->fuse_at == NOFUSE ? NOFUSE
+                                           : pool.chunks[i].base + c->fuse_at;
+            word = c->fuse_word;
+        }
+        free_pasm(c);
+    }
+    free(pool.chunks);
+    return ok;
+}
+
+char pasm_assemble_with(const char* source, size_t len,
+                        pasm_options* options, pasm_result* result) {
+    Pasm* as = new_pasm(source, len);
+    unsigned int jobs = options->jobs;
+    size_t nchunks = len / CHUNKSIZE;
+
+    pthread_once(&mnemonics_once, build_mnemonics);
+    if (nchunks > (size_t)jobs * CHUNKSPERJOB)
+        nchunks = (size_t)jobs * CHUNKSPERJOB;
+    if (jobs > nchunks) jobs = nchunks;
+
+    // -O needs the whole program at once
+    if (options->optimize || jobs < 2 || nchunks < 2 ||
+            !assemble_chunks(as, jobs, nchunks)) {
+        free_pasm(as);
+        as = new_pasm(source, len);
+        as->optimize = as->defer = options->optimize;
+        as->inline_size = options->inline_size;
+        assemble_all(as);
+    }
+    return finish(as, result);
+}
+
+char pasm_assemble(const char* source, size_t len, pasm_result* result) {
+    pasm_options options = {1, 0, 0};
+    return pasm_assemble_with(source, len, &options, result);
+}
+
+void pasm_free(pasm_result* result) {
+    free(result->image);
+    free(result->diags);
+    free(result->notes);
+    result->image = NULL;
+    result->diags = result->notes = NULL;
+    result->size = result->ndiags = result->nnotes = 0;
+}
@@ -0,0 +1,525 @@
+// P Disassembler - source file
+#include <ctype.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include "headers/pdis.h"
+#include "headers/pcode.h"
+
+char *USAGE =
+"usage: pdis [-hvg] [-p profile] file.bin\n"
+"options:\n"
+"   -h              print this help message\n"
+"   -v              print version\n"
+"   -g              print the control flow graph in DOT format\n"
+"                   instead of a listing\n"
+"   -p profile      annotate blocks with execution counts from\n"
+"                   a `pvm -p profile' run\n";
+
+void print_usage(void) {
+    fprintf(stderr, USAGE);
+    exit(1);
+}
+
+void print_version(void) {
+    printf("%s: pdis version %s\n", PROGNAME, __PDIS_VERSION__);
+    exit(EXIT_SUCCESS);
+}
+
+char load(FILE* fp) {
+    int c;
+    for (size=0; (c = fgetc(fp)) != EOF; size++) {
+        if (size >= MEMSIZE) return 1;
+        memory[size] = c;
+    }
+
+    return 0;
+}
+
+/* read `@ADDR count' lines as written by pvm -p */
+char read_profile(char* file) {
+    FILE* fp = fopen(file, "r");
+    unsigned long long n;
+    unsigned int a;
+
+    if (!fp) return 1;
+    while (fscanf(fp, " @%X %llu", &a, &n) == 2)
+        if (a < MEMSIZE) counts[a] = n;
+    fclose(fp);
+    profiled = 1;
+    return 0;
+}
+
+/* fetch the instruction at address a */
+unsigned long fetch(unsigned int a) {
+    return (unsigned long)memory[a] << 16 | memory[a + 1] << 8 |
+           memory[a + 2];
+}
+
+/* bytes taken by the instruction at a: a compare-and-branch
+ * carries the jump holding its target along, unless a skip or
+ * a jump lands on that jump too, which then stands on its own */
+unsigned int length(unsigned int a) {
+    unsigned char inst = memory[a];
+    if (a + 3 < MEMSIZE && (leader[a + 3] || target[a + 3])) return 3;
+    return inst >= 0x1A && inst <= 0x1E ? 6 : 3;
+}
+
+/* the address a jump, call, spawn or compare-and-branch at a goes to */
+unsigned int destination(unsigned int a) {
+    unsigned char inst = memory[a];
+    return (inst >= 0x1A && inst <= 0x1E ? fetch(a + 3) : fetch(a)) &
+           0xFFFF;
+}
+
+/* where control goes after the instruction at a: the successors
+ * are put in next[] and their number returned, a subroutine or
+ * thread it starts in *callee (-1 for none); *ends is set when
+ * the instruction ends its basic block */
+int flow(unsigned int a, unsigned int next[2], int* callee, FLAG* ends) {
+    unsigned long op = fetch(a);
+
+    *callee = -1;
+    *ends = 1;
+    switch (op >> 16) {
+        case 0x0:
+        case 0x12:
+            return 0;
+        case 0x4:
+            next[0] = op & 0xFFFF;
+            return 1;
+        case 0x7: case 0x8: case 0x9:
+            // the next instruction runs or is skipped
+            next[0] = a + 3;
+            next[1] = a + 6;
+            return 2;
+        case 0x1A: case 0x1B: case 0x1C: case 0x1D: case 0x1E:
+            next[0] = destination(a);
+            next[1] = a + 6;
+            return 2;
+        case 0x1F:
+            // computed: the target isn't known until run time
+            next[0] = a + 3;
+            return op & 0x1;
+        case 0x11:
+        case 0x26:
+            *callee = op & 0xFFFF;
+            // fall through
+        default:
+            *ends = 0;
+            next[0] = a + 3;
+            return 1;
+    }
+}
+
+/* mark every instruction reachable from address 0,
+ * and where basic blocks begin */
+void walk(void) {
+    unsigned int* work = malloc((2 * MEMSIZE + 1) * sizeof(*work));
+    unsigned int n = 0, a, next[2];
+    int i, count, callee;
+    FLAG ends;
+
+    leader[0] = 1;
+    work[n++] = 0;
+    while (n) {
+        a = work[--n];
+        if (a + 3 > MEMSIZE || code[a] || !known(fetch(a))) continue;
+        code[a] = 1;
+
+        count = flow(a, next, &callee, &ends);
+        if (callee != -1 && callee < MEMSIZE) {
+            leader[callee] = target[callee] = 1;
+            work[n++] = callee;
+        }
+        for (i=0; i<count; i++) {
+            if (next[i] >= MEMSIZE) continue;
+            if (ends) leader[next[i]] = 1;
+            work[n++] = next[i];
+        }
+        switch (fetch(a) >> 16) {
+            case 0x4:
+            case 0x1A: case 0x1B: case 0x1C: case 0x1D: case 0x1E:
+                if (destination(a) < MEMSIZE) target[destination(a)] = 1;
+                break;
+        }
+    }
+    free(work);
+}
+
+/* split the reachable code into basic blocks */
+void find_blocks(void) {
+    unsigned int a, next[2];
+    int callee;
+    FLAG ends;
+    Block* b = NULL;
+
+    for (a=0; a<MEMSIZE; a++) {
+        if (!code[a]) {
+            b = NULL;
+            continue;
+        }
+        if (!b || leader[a]) {
+            b = &blocks[nblocks++];
+            b->start = a;
+            b->count = counts[a];
+        }
+        b->end = a;
+        flow(a, next, &callee, &ends);
+        if (ends) b = NULL;
+        a += length(a) - 1;
+    }
+}
+
+/* the block starting at a, NULL if there is none */
+Block* block_at(unsigned int a) {
+    unsigned int lo = 0, hi = nblocks, mid;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (blocks[mid].start < a) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < nblocks && blocks[lo].start == a ? &blocks[lo] : NULL;
+}
+
+/* an address operand: the label pasm would have used, if any */
+char* address(unsigned int a, char* text) {
+    sprintf(text, a < MEMSIZE && target[a] ? "@L%04X" : "#%X", a);
+    return text;
+}
+
+/* the instruction at a in pasm syntax */
+void decode(unsigned int a, char* text) {
+    char* bitops[] = {"shl", "shr", "and", "or", "xor"};
+    char* regops[] = {"add", "sub", "mul", "div", "load"};
+    char* immops[] = {"add", "sub", "mul", "div"};
+    char* branches[] = {"jeq", "jne", "jlt", "jgt"};
+    char* memops[] = {"mcopy", "mset", "mcmp"};
+    char* strops[] = {"strlen", "memchr", "strstr", "crc32"};
+    char* stackops[] = {"push", "pop", "save", "restore"};
+    char* numops[] = {"atoi", "atox", "itoa", "itox", "itoan", "flush"};
+    char* threadops[] = {"join", "xadd", "cas", "fence"};
+    char addr[8];
+    unsigned long op = fetch(a);
+    unsigned char inst = op >> 16;
+    unsigned int x = (op >> 12) & 0xF;
+    unsigned int y = (op >> 8) & 0xF;
+    unsigned int k = op & 0xF;
+    unsigned int nnn = op & 0xFFF;
+    unsigned int mmmm = op & 0xFFFF;
+
+    if (!known(op)) {
+        sprintf(text, "; unknown 0x%06lX", op);
+        return;
+    }
+
+    switch (inst) {
+        case 0x0:
+            if (mmmm) sprintf(text, "halt    #%X", mmmm);
+            else strcpy(text, "halt");
+            break;
+        case 0x1:
+            sprintf(text, "load    r%X, #%X", x, nnn);
+            break;
+        case 0x2:
+            if (k == 0x0) sprintf(text, "fill    r%X", x);
+            if (k == 0x1) sprintf(text, "store   r%X", x);
+            if (k == 0x2) sprintf(text, "load    r%X, [X]", x);
+            if (k == 0x3) sprintf(text, "load    [X], r%X", x);
+            break;
+        case 0x3:
+            sprintf(text, "load    [X], #%X", mmmm);
+            break;
+        case 0x4:
+            sprintf(text, "jump    %s", address(mmmm, addr));
+            break;
+        case 0x5:
+            if (x == 0x0) strcpy(text, "print0");
+            if (x == 0x1) sprintf(text, "print   #%X", nnn & 0xFFF);
+            if (x == 0x2) sprintf(text, "putchar #%X", nnn & 0xFF);
+            if (x == 0x3) strcpy(text, "printi");
+            break;
+        case 0x6:
+            strcpy(text, "input");
+            break;
+        case 0x7:
+            sprintf(text, "ifneq   r%X, #%X", x, nnn);
+            break;
+        case 0x8:
+            sprintf(text, "ifeq    r%X, #%X", x, nnn);
+            break;
+        case 0x9:
+            sprintf(text, "%-7s r%X, r%X", k ? "ifeq" : "ifneq", x, y);
+            break;
+        case 0xA: case 0xB:
+            sprintf(text, "%-7s [X], #%X", immops[inst - 0xA], mmmm);
+            break;
+        case 0xC: case 0xD: case 0xE: case 0xF:
+            sprintf(text, "%-7s r%X, #%X", immops[inst - 0xC], x, nnn);
+            break;
+        case 0x10:
+            sprintf(text, "%-7s r%X, r%X",
+                    k <= 0x4 ? regops[k] : bitops[k - 0x5], x, y);
+            break;
+        case 0x11:
+            sprintf(text, "call    %s", address(mmmm, addr));
+            break;
+        case 0x12:
+            strcpy(text, "ret");
+            break;
+        case 0x13:
+            sprintf(text, "switchx #%X", k);
+            break;
+        case 0x14:
+            sprintf(text, "%-7s r%X, r%X", k ? "banks" : "bank", x, y);
+            break;
+        case 0x15:
+            strcpy(text, mmmm ? "wide" : "; narrow");
+            break;
+        case 0x16:
+            sprintf(text, "%-7s r%X, #%X", bitops[y], x, (unsigned)op & 0xFF);
+            break;
+        case 0x17:
+            // part of a wide `load rx, #NUM'
+            sprintf(text, "; shift #%X into r%X", nnn, x);
+            break;
+        case 0x18:
+            if (k == 0x1)
+                sprintf(text, "mset    #%X, r%X, r%X", x, y,
+                        (unsigned)(op >> 4) & 0xF);
+            else
+                sprintf(text, "%-7s #%X, #%X, r%X", memops[k], x, y,
+                        (unsigned)(op >> 4) & 0xF);
+            break;
+        case 0x19:
+            if (k == 0x0) sprintf(text, "strlen  r%X", x);
+            else sprintf(text, k == 0x2 ? "%-7s r%X, #%X" : "%-7s r%X, r%X",
+                         strops[k], x, y);
+            break;
+        case 0x1A: case 0x1B: case 0x1C: case 0x1D:
+            sprintf(text, "%-7s r%X, #%X, %s", branches[inst - 0x1A], x,
+                    nnn, address(destination(a), addr));
+            break;
+        case 0x1E:
+            sprintf(text, "%-7s r%X, r%X, %s", branches[k], x, y,
+                    address(destination(a), addr));
+            break;
+        case 0x1F:
+            sprintf(text, "%-7s %sr%X", k & 0x1 ? "call" : "jump",
+                    k & 0x2 ? "[X], " : "", x);
+            break;
+        case 0x20:
+            if (k <= 0x1) sprintf(text, "%-7s r%X", stackops[k], x);
+            else sprintf(text, "%-7s r%X, r%X", stackops[k], x, y);
+            break;
+        case 0x21:
+            if (k == 0x0) sprintf(text, "alloc   r%X", x);
+            else strcpy(text, k == 0x1 ? "free" : "freeall");
+            break;
+        case 0x22:
+            if (k == 0x5) strcpy(text, "flush");
+            else sprintf(text, "%-7s r%X", numops[k], x);
+            break;
+        case 0x23:
+            sprintf(text, "%-7s r%X, r%X", k ? "clock" : "cycles", x, y);
+            break;
+        case 0x24:
+            sprintf(text, "%s #%X", y ? "region.end" : "region.begin",
+                    (unsigned)op & 0xFF);
+            break;
+        case 0x25:
+            sprintf(text, "hostcall #%X", (unsigned)op & 0xFF);
+            break;
+        case 0x26:
+            sprintf(text, "spawn   %s", address(mmmm, addr));
+            break;
+        case 0x27:
+            if (k == 0x3) strcpy(text, "fence");
+            else if (k == 0x2) sprintf(text, "cas     r%X, r%X", x, y);
+            else sprintf(text, "%-7s r%X", threadops[k], x);
+            break;
+        case 0x28:
+            sprintf(text, "%-7s r%X, #%X", k ? "recv" : "send", x, y);
+            break;
+    }
+}
+
+/* print the bytes from a to end as string, stringl and char
+ * directives */
+void data(unsigned int a, unsigned int end) {
+    unsigned int n;
+
+    while (a < end) {
+        // a run of printable characters up to a \0
+        for (n=0; a + n < end && isprint(memory[a + n]); n++);
+        if (n && a + n < end && !memory[a + n]) {
+            printf("    string  \"%.*s\"\n", n, (char*)&memory[a]);
+            a += n + 1;
+        } else if (n && a + n + 1 < end && memory[a + n] == '\n' &&
+                   !memory[a + n + 1]) {
+            printf("    stringl \"%.*s\"\n", n, (char*)&memory[a]);
+            a += n + 2;
+        } else {
+            printf("    char    #%X\n", memory[a]);
+            a++;
+        }
+    }
+}
+
+/* instructions executed in block b */
+unsigned long long block_total(Block* b) {
+    unsigned long long total = 0;
+    unsigned int a;
+    for (a=b->start; a<=b->end; a += length(a)) total += counts[a];
+    return total;
+}
+
+void listing(char* fn) {
+    unsigned long long total = 0;
+    unsigned int a, end, i;
+    char text[64];
+    Block* b;
+
+    for (i=0; i<nblocks; i++) total += block_total(&blocks[i]);
+    printf("; %s: %u blocks\n", fn, nblocks);
+
+    for (a=0; a<size; ) {
+        if (!code[a]) {
+            for (end=a; end<size && !code[end]; end++);
+            printf("\n; data @%04X\n", a);
+            data(a, end);
+            a = end;
+            continue;
+        }
+
+        b = block_at(a);
+        if (b && profiled)
+            printf("\n; block @%04X: ran %llu times, %.1f%% of "
+                   "instructions\n", a, b->count,
+                   total ? 100.0 * block_total(b) / total : 0.0);
+        else if (b)
+            printf("\n; block @%04X\n", a);
+        if (target[a]) printf("L%04X:\n", a);
+
+        decode(a, text);
+        printf("    %-32s; %04X: %06lX", text, a, fetch(a));
+        if (length(a) == 6) printf(" %06lX", fetch(a + 3));
+        printf("\n");
+        a += length(a);
+    }
+}
+
+/* the control flow graph, blocks shaded by how often they ran */
+void graph(char* fn) {
+    unsigned long long most = 1;
+    unsigned int i, j, a, next[2];
+    int count, callee;
+    char text[64];
+    FLAG ends;
+    Block* b;
+
+    for (i=0; i<nblocks; i++)
+        if (blocks[i].count > most) most = blocks[i].count;
+
+    printf("digraph \"%s\" {\n", fn);
+    printf("    node [shape=box, fontname=monospace, style=filled, "
+           "colorscheme=reds9];\n");
+    for (i=0; i<nblocks; i++) {
+        b = &blocks[i];
+        printf("    b%04X [fillcolor=%llu, label=\"", b->start,
+               profiled ? 1 + 8 * b->count / most : 1);
+        if (profiled) printf("%llu\\l", b->count);
+        for (a=b->start; a<=b->end; a += length(a)) {
+            decode(a, text);
+            printf("%04X  %s\\l", a, text);
+        }
+        printf("\"];\n");
+
+        for (a=b->start; a<=b->end; a += length(a)) {
+            count = flow(a, next, &callee, &ends);
+            if (callee != -1 && block_at(callee))
+                printf("    b%04X -> b%04X [style=dashed];\n",
+                       b->start, callee);
+            if (a != b->end) continue;
+            for (j=0; j<(unsigned)count; j++)
+                if (block_at(next[j]))
+                    printf("    b%04X -> b%04X;\n", b->start, next[j]);
+        }
+    }
+    printf("}\n");
+}
+
+int main(int argc, char* argv[]) {
+    PROGNAME = argv[0];
+    char* fn = NULL;
+    char* pfile = NULL;
+    FLAG  gflag = 0;
+    FILE* fp;
+    int c;
+
+    opterr = 0;
+
+    while ((c = getopt(argc, argv, "hvgp:")) != -1)
+        switch (c) {
+            case 'h':
+                print_usage();
+                break;
+            case 'v':
+                print_version();
+                break;
+            case 'g':
+                gflag = 1;
+                break;
+            case 'p':
+                pfile = optarg;
+                break;
+            case '?':
+                if (optopt == 'p')
+                    fprintf(stderr,
+                        "%s: option `%c' expects an argument.\n",
+                        PROGNAME, optopt);
+                else if (isprint(optopt))
+                    fprintf(stderr,
+                        "%s: unknown option: `-%c'.\n", PROGNAME,
+                        optopt);
+                else
+                    fprintf(stderr,
+                        "%s: unknown option character: `\\x%x'.\n",
+                        PROGNAME,
+                        optopt);
+                return 1;
+                break;
+            default:
+                abort();
+        }
+
+    argc -= optind;
+    if (argc != 1) print_usage();
+    fn = argv[optind];
+
+    fp = fopen(fn, "rb");
+    if (!fp) {
+        fprintf(stderr, "%s: failed to open file: `%s'.\n",
+                PROGNAME, fn);
+        return 1;
+    }
+    if (load(fp)) {
+        fprintf(stderr, "%s: file too big: `%s'.\n", PROGNAME, fn);
+        return 1;
+    }
+    fclose(fp);
+
+    if (pfile && read_profile(pfile)) {
+        fprintf(stderr, "%s: failed to read profile: `%s'.\n",
+                PROGNAME, pfile);
+        return 1;
+    }
+
+    walk();
+    find_blocks();
+    if (gflag) graph(fn);
+    else listing(fn);
+
+    return 0;
+}
@@ -5,29 +5,128 @@
 #include <signal.h>
 #include <ctype.h>
 #include <stdio.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+// crc32 is picked at run time, see crc32c
+#include <nmmintrin.h>
+#endif
+#include "headers/libpvm.h"
 #include "headers/pvm.h"
+#include "headers/pcode.h"
 
-char *USAGE = 
-"usage: pvm [-hv] file.bin\n"
+#ifndef LIBPVM
+static char *USAGE = 
+"usage: pvm [-hv] file.bin [file.bin...]\n"
 "options:\n"
 "   -h              print this help message\n"
 "   -d              at the end of execution print debugging info\n"
 "   -m file.bin     at the end of execution du"
                         "mp memory into a file\n"
 "   -v              print version\n"
-"   -i              print each executed opcode\n";
+"   -i              print each executed opcode\n"
+"   -V              refuse to run programs that fail verification\n"
+"   -s depth        entries in the call and data stacks "
+                        "(default 256)\n"
+"   -b file         back the bank window with file instead of\n"
+"                   anonymous memory\n"
+"   -r, --per-record\n"
+"                   run the program once per line of input,\n"
+"                   `input' returns the current line\n"
+"   -t a:b,...      connect the programs with channels from\n"
+"                   program a to program b, counting from 0;\n"
+"                   by default each one sends to the next\n"
+"   -p file         count how often each address of a single\n"
+"                   program runs and write the counts to file,\n"
+"                   see pdis\n"
+"   --record log    write every input line, and where the run\n"
+"                   was interrupted, to log\n"
+"   --replay log    rerun a recorded run, reading input from log\n";
 
-void print_usage() {
+static struct option long_options[] = {
+    {"per-record", no_argument, NULL, 'r'},
+    {"record", required_argument, NULL, 'R'},
+    {"replay", required_argument, NULL, 'P'},
+    {NULL, 0, NULL, 0}
+};
+
+static void print_usage() {
     fprintf(stderr, USAGE);
     exit(1);
 }
 
-void print_version() {
+static void print_version() {
     printf("%s: pvm version %s\n", PROGNAME, __PVM_VERSION__);
     exit(0);
 }
+#endif
+
+/* allocate size bytes between two inaccessible pages, the end of
+ * the block right against the upper one */
+static void* guarded_alloc(size_t size) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t rounded = (size + page - 1) / page * page;
+    char* base = mmap(NULL, rounded + 2 * page, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED ||
+            mprotect(base + page, rounded, PROT_READ | PROT_WRITE)) {
+        fprintf(stderr, "%s: out of memory.\n", PROGNAME);
+        exit(EXIT_FAILURE);
+    }
+
+    return base + page + (rounded - size);
+}
+
+/* give back a block from guarded_alloc */
+static void guarded_free(void* p, size_t size) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t rounded = (size + page - 1) / page * page;
+    munmap((char*)p - (rounded - size) - page, rounded + 2 * page);
+}
+
+/* a program with empty memory and nothing connected */
+static Vm* new_vm(void) {
+    Vm* v = calloc(1, sizeof(*v));
+    if (!v) {
+        fprintf(stderr, "%s: out of memory.\n", PROGNAME);
+        exit(EXIT_FAILURE);
+    }
+    v->memory = guarded_alloc((MEMSIZE + MEMPAD) * sizeof(*v->memory));
+    v->heaptop = v->heapbase = HEAPBASE;
+    pthread_mutex_init(&v->lock, NULL);
+    return v;
+}
+
+/* make this thread run v */
+static void use_vm(Vm* v) {
+    vm = v;
+    memory = v->memory;
+    verified = v->verified;
+    profile = v->profile;
+}
+
+/* stacks and X slots for this thread */
+static void thread_init(void) {
+    pc_stack = guarded_alloc(stacksize * sizeof(*pc_stack));
+    data_stack = guarded_alloc(stacksize * sizeof(*data_stack));
+    arrayX = guarded_alloc(XSLOTS * sizeof(*arrayX));
+    X = &arrayX[0];
+}
+
+static void thread_free(void) {
+    guarded_free(pc_stack, stacksize * sizeof(*pc_stack));
+    guarded_free(data_stack, stacksize * sizeof(*data_stack));
+    guarded_free(arrayX, XSLOTS * sizeof(*arrayX));
+}
 
-char load(FILE* fp) {
+static char load(FILE* fp) {
     int c;
     unsigned int i;
     for (i=0; (c = fgetc(fp)) != EOF; i++) {
@@ -35,22 +134,679 @@ char load(FILE* fp) {
         memory[i] = c;
     }
 
+    // the heap must not hand out the program
+    vm->heapbase = (i + 3) & ~3u;
+    if (vm->heapbase < HEAPBASE) vm->heapbase = HEAPBASE;
+    vm->heaptop = vm->heapbase;
+    return 0;
+}
+
+/* map the bank backing: the whole of file, or when file is NULL
+ * ANONBANKS windows of anonymous memory, paged in on first touch */
+static char map_banks(char* file) {
+    struct stat st;
+    int fd;
+
+    if (!file) {
+        vm->banklen = (size_t)ANONBANKS * BANKSTRIDE;
+        vm->bankmem = mmap(NULL, vm->banklen, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                       -1, 0);
+        return vm->bankmem == MAP_FAILED;
+    }
+
+    fd = open(file, O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) || !st.st_size) return 1;
+    vm->banklen = st.st_size;
+    // writes stay private to this run
+    vm->bankmem = mmap(NULL, vm->banklen, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE, fd, 0);
+    close(fd);
+    return vm->bankmem == MAP_FAILED;
+}
+
+static unsigned int peek(unsigned int a) {
+    size_t off = winoff + (a - BANKBASE);
+    return off < vm->banklen ? vm->bankmem[off] : 0;
+}
+
+static void poke(unsigned int a, unsigned int v) {
+    size_t off = winoff + (a - BANKBASE);
+    if (off < vm->banklen) vm->bankmem[off] = v;
+}
+
+/* clamp the n cells from a to the end of memory */
+static unsigned int span(unsigned int a, unsigned int n) {
+    return a >= MEMSIZE ? 0 : n > MEMSIZE - a ? MEMSIZE - a : n;
+}
+
+/* do the n cells from a all live in memory[] */
+static char flat(unsigned int a, unsigned int n) {
+    return !banked || a + n <= BANKBASE;
+}
+
+/* DIRTY for the n cells from a */
+static void dirty_range(unsigned int a, unsigned int n) {
+    unsigned int p;
+    if (!n || !rflag) return;
+    for (p = a / PAGESIZE; p <= (a + n - 1) / PAGESIZE; p++)
+        __atomic_store_n(&dirty[p], 1, __ATOMIC_RELAXED);
+}
+
+/* the n cells from a were written: the instructions overlapping
+ * them are no longer the ones verify() checked */
+static void unverify(unsigned int a, unsigned int n) {
+    unsigned int end = a + n > MEMSIZE ? MEMSIZE : a + n;
+    for (a = a < 2 ? 0 : a - 2; a < end; a++)
+        __atomic_store_n(&verified[a], 0, __ATOMIC_RELAXED);
+}
+
+/* bulk memory kernels: memmove is already vectorized by libc,
+ * set and compare do four cells per SSE2 instruction */
+static void copy_cells(unsigned int d, unsigned int s, unsigned int n) {
+    unsigned int j;
+    n = span(d, span(s, n));
+    if (flat(d, n) && flat(s, n)) {
+        memmove(&memory[d], &memory[s], n * sizeof(*memory));
+        dirty_range(d, n);
+        unverify(d, n);
+    } else if (d <= s) {
+        for (j=0; j<n; j++) POKE(d + j, PEEK(s + j));
+    } else {
+        for (j=n; j>0; j--) POKE(d + j - 1, PEEK(s + j - 1));
+    }
+}
+
+static void set_cells(unsigned int d, unsigned int v, unsigned int n) {
+    unsigned int j = 0;
+    n = span(d, n);
+    if (!flat(d, n)) {
+        for (; j<n; j++) POKE(d + j, v);
+        return;
+    }
+#ifdef __SSE2__
+    __m128i vv = _mm_set1_epi32(v);
+    for (; j + 4 <= n; j += 4)
+        _mm_storeu_si128((__m128i*)&memory[d + j], vv);
+#endif
+    for (; j<n; j++) memory[d + j] = v;
+    dirty_range(d, n);
+    unverify(d, n);
+}
+
+/* 0 if the n cells at a and b are equal,
+ * 1 if a sorts first, 2 if b does */
+static unsigned int compare_cells(unsigned int a, unsigned int b,
+                                  unsigned int n) {
+    unsigned int j = 0, ca, cb;
+    n = span(a, span(b, n));
+    if (flat(a, n) && flat(b, n)) {
+#ifdef __SSE2__
+        for (; j + 4 <= n; j += 4) {
+            __m128i va = _mm_loadu_si128((__m128i*)&memory[a + j]);
+            __m128i vb = _mm_loadu_si128((__m128i*)&memory[b + j]);
+            if (_mm_movemask_epi8(_mm_cmpeq_epi32(va, vb)) != 0xFFFF)
+                break;
+        }
+#endif
+        for (; j<n && memory[a + j] == memory[b + j]; j++);
+        if (j == n) return 0;
+        return memory[a + j] < memory[b + j] ? 1 : 2;
+    }
+
+    for (; j<n; j++) {
+        ca = PEEK(a + j);
+        cb = PEEK(b + j);
+        if (ca != cb) return ca < cb ? 1 : 2;
+    }
+    return 0;
+}
+
+/* offset of the first of the n cells from a equal to v, n if none */
+static unsigned int find_cell(unsigned int a, unsigned int n, unsigned int v) {
+    unsigned int j = 0;
+    n = span(a, n);
+    if (!flat(a, n)) {
+        for (; j<n && PEEK(a + j) != v; j++);
+        return j;
+    }
+#ifdef __SSE2__
+    __m128i vv = _mm_set1_epi32(v);
+    int mask;
+    for (; j + 4 <= n; j += 4) {
+        mask = _mm_movemask_epi8(_mm_cmpeq_epi32(vv,
+                   _mm_loadu_si128((__m128i*)&memory[a + j])));
+        if (mask) return j + __builtin_ctz(mask) / 4;
+    }
+#endif
+    for (; j<n && memory[a + j] != v; j++);
+    return j;
+}
+
+/* offset of the 0 terminated string at b inside the one at a,
+ * -1 if it doesn't occur */
+static int find_string(unsigned int a, unsigned int b) {
+    unsigned int len = find_cell(a, MEMSIZE, 0);
+    unsigned int sublen = find_cell(b, MEMSIZE, 0);
+    unsigned int j = 0;
+
+    if (!sublen) return 0;
+    while (j + sublen <= len) {
+        j += find_cell(a + j, len - sublen + 1 - j, PEEK(b));
+        if (j + sublen > len) break;
+        if (!compare_cells(a + j, b, sublen)) return j;
+        j++;
+    }
+    return -1;
+}
+
+static unsigned int crc_table[0x100];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void build_crc_table(void) {
+    unsigned int b, c, j;
+    for (b=0; b<0x100; b++) {
+        for (c=b, j=0; j<8; j++)
+            c = c & 1 ? c >> 1 ^ 0x82F63B78 : c >> 1;
+        crc_table[b] = c;
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* crc32c with the SSE4.2 crc32 instruction, for CPUs that have it */
+__attribute__((target("sse4.2")))
+static unsigned int crc32c_sse42(unsigned int a, unsigned int n) {
+    unsigned int crc = ~0, j = 0;
+
+    if (flat(a, n)) {
+        for (; j + 4 <= n; j += 4)
+            crc = _mm_crc32_u32(crc,
+                    (memory[a + j] & 0xFF) |
+                    (memory[a + j + 1] & 0xFF) << 8 |
+                    (memory[a + j + 2] & 0xFF) << 16 |
+                    (memory[a + j + 3] & 0xFF) << 24);
+    }
+    for (; j<n; j++)
+        crc = _mm_crc32_u8(crc, PEEK(a + j));
+    return ~crc;
+}
+#endif
+
+/* CRC-32C of the low bytes of the n cells from a, with the SSE4.2
+ * crc32 instruction when the CPU has it, otherwise a table */
+static unsigned int crc32c(unsigned int a, unsigned int n) {
+    unsigned int crc = ~0, j;
+
+    n = span(a, n);
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("sse4.2")) return crc32c_sse42(a, n);
+#endif
+    pthread_once(&crc_once, build_crc_table);
+    for (j=0; j<n; j++)
+        crc = crc >> 8 ^ crc_table[(crc ^ PEEK(a + j)) & 0xFF];
+    return ~crc;
+}
+
+/* address of a free block of at least n cells, 0 if there is none */
+static unsigned int heap_alloc(unsigned int n) {
+    unsigned int c, a;
+
+    for (c=0; c<HEAPCLASSES && (4u << c) < n; c++);
+    if (c == HEAPCLASSES) return 0;
+
+    if (vm->freelist[c]) {
+        a = vm->freelist[c];
+        vm->freelist[c] = vm->heapnext[(a - HEAPBASE) / 4];
+    } else if (vm->heaptop + (4u << c) <= HEAPEND) {
+        a = vm->heaptop;
+        vm->heaptop += 4u << c;
+    } else
+        return 0;
+
+    vm->heapclass[(a - HEAPBASE) / 4] = c + 1;
+    return a;
+}
+
+/* return the block at a to its free list,
+ * 1 if a isn't an allocated block */
+static char heap_free(unsigned int a) {
+    unsigned int b = (a - HEAPBASE) / 4, c;
+
+    if (a < HEAPBASE || a >= vm->heaptop || a % 4 || !vm->heapclass[b])
+        return 1;
+
+    c = vm->heapclass[b] - 1;
+    vm->heapclass[b] = 0;
+    vm->heapnext[b] = vm->freelist[c];
+    vm->freelist[c] = a;
     return 0;
 }
 
-/* read line, return size */
-size_t readline(char line[], size_t size) {
-    size_t i;
+/* drop every allocation at once */
+static void heap_reset(void) {
+    memset(vm->heapclass, 0, sizeof(vm->heapclass));
+    memset(vm->freelist, 0, sizeof(vm->freelist));
+    vm->heaptop = vm->heapbase;
+}
+
+static void flush_out(void) {
+    fwrite(outbuf, 1, outlen, stdout);
+    outlen = 0;
+}
+
+/* append v to outbuf in decimal, or hex if hex is set */
+static void format_number(unsigned int v, FLAG hex) {
+    char digits[10];
+    int n = 0;
+
+    // leaves room for a separator after the number
+    if (outlen + sizeof(digits) >= OUTSIZE) flush_out();
+    do {
+        digits[n++] = "0123456789ABCDEF"[hex ? v & 0xF : v % 10];
+        v = hex ? v >> 4 : v / 10;
+    } while (v);
+    while (n) outbuf[outlen++] = digits[--n];
+}
+
+/* parse the decimal or hex number at [X] into a register value,
+ * moving [X] past it; leading blanks are skipped */
+static unsigned int parse_number(FLAG hex) {
+    unsigned int v = 0, c;
+
+    while ((c = PEEK(*X)) == ' ' || c == '\t') *X = (*X + 1) & 0xFFFF;
+    for (;; *X = (*X + 1) & 0xFFFF) {
+        c = PEEK(*X);
+        if (c >= '0' && c <= '9') c -= '0';
+        else if (hex && (c | 0x20) >= 'a' && (c | 0x20) <= 'f')
+            c = (c | 0x20) - 'a' + 10;
+        else break;
+        v = hex ? v << 4 | c : v * 10 + c;
+    }
+    return v & regmask;
+}
+
+/* the data of the next --replay entry if it is a `kind' one,
+ * its number in *n; NULL otherwise */
+static char* replay_entry(char* kind, size_t* n) {
+    char* p = replay + replaypos;
+    char* end;
+    size_t len = strlen(kind);
+
+    if (replaypos >= replaylen || strncmp(p, kind, len) || p[len] != ' ')
+        return NULL;
+    *n = strtoull(p + len + 1, &end, 10);
+    if (*end != '\n' || *n > replaylen - (end + 1 - replay))
+        return NULL;
+    return end + 1;
+}
+
+static size_t readline(char line[], size_t size) {
+    size_t i, n;
+    char* data;
     int c;
+
+    if (replay) {
+        // running out of lines is the end of input
+        data = replay_entry("line", &n);
+        if (!data) n = 0;
+        else replaypos = data - replay + n + 1;
+        i = n < size ? n : size;
+        if (i) memcpy(line, data, i);
+        line[i] = '\0';
+        return i;
+    }
+
     for (i=0; (c = getchar()) != EOF &&
                 c != '\n' && i < size; i++)
         line[i] = c;
 
     line[i] = '\0';
+    // nothing is logged at the end of input, so a replay
+    // sees it where the log ends
+    if (recfile && (i || c != EOF)) {
+        fprintf(recfile, "line %zu\n", i);
+        fwrite(line, 1, i, recfile);
+        fputc('\n', recfile);
+        fflush(recfile);
+    }
     return i;
 }
 
-void debug(FLAG dflag, char* mfile) {
+/* line for the input opcode: in --per-record mode
+ * the current record (only once per run), otherwise stdin */
+static size_t getinput(char line[], size_t size) {
+    if (!rflag) return readline(line, size);
+
+    memcpy(line, record, recordsize + 1);
+    size = recordsize;
+    record[0] = '\0';
+    recordsize = 0;
+    return size;
+}
+
+#ifndef LIBPVM
+/* load the --replay log, 1 if it can't be read; a recorded
+ * interrupt is the entry after the last line */
+static char open_replay(char* file) {
+    FILE* fp = fopen(file, "rb");
+    char* data;
+    size_t len;
+    long n;
+
+    if (!fp || fseek(fp, 0, SEEK_END) || (n = ftell(fp)) < 0) return 1;
+    rewind(fp);
+    replay = malloc(n + 1);
+    replaylen = fread(replay, 1, n, fp);
+    replay[replaylen] = '\0';
+    fclose(fp);
+
+    // step over the lines by their lengths, as their data
+    // may look like any entry
+    while ((data = replay_entry("line", &len)))
+        replaypos = data - replay + len + 1;
+    if (!strncmp(replay + replaypos, "sigint ", 7))
+        stop_at = strtoull(replay + replaypos + 7, NULL, 10);
+    replaypos = 0;
+    return 0;
+}
+
+/* read the next record for --per-record mode,
+ * return 0 at the end of input */
+static char next_record(void) {
+    size_t n;
+    int c;
+
+    if (replay && !replay_entry("line", &n)) return 0;
+    if (!replay) {
+        c = getchar();
+        if (c == EOF) return 0;
+        ungetc(c, stdin);
+    }
+
+    recordsize = readline(record, MEMSIZE);
+    return 1;
+}
+
+/* bring memory and registers back to the state load() left
+ * them in, copying back only the pages written since */
+static void reset(void) {
+    unsigned int p, start, size;
+    for (p=0; p<PAGES; p++) {
+        if (!dirty[p]) continue;
+        start = p * PAGESIZE;
+        // the last page runs into the pad that fill and store write
+        size = start + PAGESIZE > MEMSIZE + MEMPAD ?
+               MEMSIZE + MEMPAD - start : PAGESIZE;
+        memcpy(&memory[start], &image[start], size * sizeof(*memory));
+        dirty[p] = 0;
+    }
+
+    memset(reg, 0, sizeof(reg));
+    memset(pc_stack, 0, stacksize * sizeof(*pc_stack));
+    memset(data_stack, 0, stacksize * sizeof(*data_stack));
+    memset(arrayX, 0, XSLOTS * sizeof(*arrayX));
+    psp = 0;
+    dsp = 0;
+    halt = 0;
+    banked = 0;
+    winoff = 0;
+    wide = 0;
+    regmask = 0xFFF;
+    X = &arrayX[0];
+    heap_reset();
+}
+#endif
+
+/* fetch the instruction at address a */
+static unsigned long fetch(unsigned int a) {
+    return (unsigned long)memory[a] << 16 | memory[a + 1] << 8 |
+           memory[a + 2];
+}
+
+/* walk the code reachable from a and return its deepest call nesting,
+ * or UNBOUNDED if it recurses or cannot be bounded;
+ * depth[] memoizes call targets: 0 while unknown, UNBOUNDED
+ * while being walked, their nesting + 1 once known */
+static unsigned int call_depth(unsigned int a, FLAG entry,
+                               unsigned int* seen, unsigned int* depth) {
+    static unsigned int walks = 0;
+    unsigned int stamp = ++walks;
+    unsigned int n = 0, size = 0x40, max = 0, d, target;
+    unsigned int* work = malloc(size * sizeof(*work));
+    unsigned long op;
+
+    depth[a] = UNBOUNDED;
+    work[n++] = a;
+    while (n) {
+        a = work[--n];
+        if (a + 3 > MEMSIZE || seen[a] == stamp) continue;
+        seen[a] = stamp;
+
+        if (n + 2 > size)
+            work = realloc(work, (size *= 2) * sizeof(*work));
+
+        op = fetch(a);
+        if (!known(op)) continue;
+        target = op & 0xFFFF;
+        switch (op >> 16) {
+            case 0x0:
+                break;
+            case 0x4:
+                work[n++] = target;
+                break;
+            case 0x7: case 0x8: case 0x9:
+                work[n++] = a + 3;
+                work[n++] = a + 6;
+                break;
+            case 0x1A: case 0x1B: case 0x1C: case 0x1D: case 0x1E:
+                work[n++] = fetch(a + 3) & 0xFFFF;
+                work[n++] = a + 6;
+                break;
+            case 0x1F:
+                // computed jumps and calls can go anywhere
+                max = UNBOUNDED;
+                if (op & 0x1) work[n++] = a + 3;
+                break;
+            case 0x26:
+                // a thread returning from its entry point
+                // runs off its own, empty stack
+                max = UNBOUNDED;
+                work[n++] = a + 3;
+                break;
+            case 0x11:
+                if (target + 3 > MEMSIZE) break;
+                d = depth[target];
+                if (!d) {
+                    d = call_depth(target, 0, seen, depth);
+                    d = depth[target] = d == UNBOUNDED ? d : d + 1;
+                }
+                if (d > max) max = d;
+                work[n++] = a + 3;
+                break;
+            case 0x12:
+                // a return reachable from the entry point
+                // pops a frame that was never pushed
+                if (entry) max = UNBOUNDED;
+                break;
+            default:
+                work[n++] = a + 3;
+                break;
+        }
+    }
+    free(work);
+    return max;
+}
+
+/* prove what can be proven about the loaded program: mark every
+ * reachable, well formed instruction in verified[], report the rest;
+ * calls and returns are only marked when the call nesting fits
+ * in pc_stack, so that execute() can skip checking them */
+static char verify(void) {
+    // successors of the last instructions, and targets, reach past
+    // the end of memory, by up to 6
+    unsigned int* seen = calloc(MEMSIZE + 6, sizeof(*seen));
+    unsigned int* depth = calloc(MEMSIZE, sizeof(*depth));
+    unsigned int* work = malloc((2 * MEMSIZE + 1) * sizeof(*work));
+    unsigned int n = 0, a, target, errors = 0;
+    unsigned long op;
+    FLAG bounded;
+
+    memset(verified, 0, MEMSIZE);
+    vm->hosted = 0;
+    bounded = call_depth(0, 1, seen, depth) <= stacksize;
+
+    memset(seen, 0, (MEMSIZE + 6) * sizeof(*seen));
+    work[n++] = 0;
+    while (n) {
+        a = work[--n];
+        if (seen[a]) continue;
+        seen[a] = 1;
+
+        if (a + 3 > MEMSIZE) {
+            fprintf(stderr, "%s: @%04X: execution runs past "
+                    "the end of memory\n", PROGNAME, a);
+            errors++;
+            continue;
+        }
+        op = fetch(a);
+        if (!known(op)) {
+            fprintf(stderr, "%s: @%04X: unknown opcode 0x%06lX\n",
+                    PROGNAME, a, op);
+            errors++;
+            continue;
+        }
+
+        target = op & 0xFFFF;
+        verified[a] = 1;
+        switch (op >> 16) {
+            case 0x0:
+                break;
+            case 0x4:
+            case 0x11:
+            case 0x26:
+                if (target + 3 > MEMSIZE) {
+                    fprintf(stderr, "%s: @%04X: target @%04X out "
+                            "of range\n", PROGNAME, a, target);
+                    verified[a] = 0;
+                    errors++;
+                    break;
+                }
+                work[n++] = target;
+                if (op >> 16 == 0x11) verified[a] = bounded;
+                if (op >> 16 != 0x4) work[n++] = a + 3;
+                break;
+            case 0x7: case 0x8: case 0x9:
+                work[n++] = a + 3;
+                work[n++] = a + 6;
+                break;
+            case 0x1A: case 0x1B: case 0x1C: case 0x1D: case 0x1E:
+                // the target comes from the jump that follows
+                if (a + 6 > MEMSIZE || fetch(a + 3) >> 16 != 0x4) {
+                    fprintf(stderr, "%s: @%04X: branch without "
+                            "a target\n", PROGNAME, a);
+                    verified[a] = 0;
+                    errors++;
+                    break;
+                }
+                work[n++] = a + 3;
+                work[n++] = a + 6;
+                break;
+            case 0x12:
+                verified[a] = bounded;
+                break;
+            case 0x1F:
+                // where these go is only known at run time
+                if (op & 0x1) work[n++] = a + 3;
+                verified[a] = 0;
+                break;
+            default:
+                work[n++] = a + 3;
+                break;
+        }
+    }
+
+    free(seen);
+    free(depth);
+    free(work);
+    return errors != 0;
+}
+
+static unsigned long long nanoseconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* split v over rx (high bits) and ry (low bits) */
+static void split(unsigned long long v) {
+    unsigned int bits = wide ? 32 : 12;
+    reg[x] = (v >> bits) & regmask;
+    reg[y] = v & regmask;
+}
+
+static void region(unsigned char id, FLAG end) {
+    Region* r = &regions[id];
+
+    if (!end) {
+        if (!r->depth++) {
+            r->start_ns = nanoseconds();
+            r->start_icount = icount;
+        }
+    } else if (r->depth && !--r->depth) {
+        r->ns += nanoseconds() - r->start_ns;
+        r->insts += icount - r->start_icount;
+        r->hits++;
+    }
+}
+
+/* add what the region markers of this thread collected to the
+ * totals of its program, once it is done running */
+static void fold_regions(void) {
+    unsigned int i;
+
+    pthread_mutex_lock(&vm->lock);
+    for (i=0; i<REGIONS; i++) {
+        vm->regions[i].ns += regions[i].ns;
+        vm->regions[i].insts += regions[i].insts;
+        vm->regions[i].hits += regions[i].hits;
+    }
+    pthread_mutex_unlock(&vm->lock);
+    memset(regions, 0, sizeof(regions));
+}
+
+#ifndef LIBPVM
+/* write how often each address ran, one `@ADDR count' per
+ * line, for pdis to annotate its listing with */
+static char write_profile(char* file) {
+    FILE* fp = fopen(file, "w");
+    unsigned int a;
+
+    if (!fp) return 1;
+    for (a=0; a<MEMSIZE; a++)
+        if (profile[a]) fprintf(fp, "@%04X %llu\n", a, profile[a]);
+    return fclose(fp) != 0;
+}
+
+/* print what the region markers of program v collected, under
+ * its file name fn when there is more than one program */
+static void report_regions(Vm* v, char* fn) {
+    Region* r = v->regions;
+    unsigned int i;
+    FLAG header = 0;
+
+    for (i=0; i<REGIONS; i++) {
+        if (!r[i].hits) continue;
+        if (!header++) {
+            if (fn) fprintf(stderr, "%s: %s:\n", PROGNAME, fn);
+            fprintf(stderr, "%s: region %10s %14s %14s\n", PROGNAME,
+                    "hits", "instructions", "ns");
+        }
+        fprintf(stderr, "%s:     %02X %10llu %14llu %14llu\n",
+                PROGNAME, i, r[i].hits, r[i].insts, r[i].ns);
+    }
+}
+
+static void debug(FLAG dflag, char* mfile) {
     if (dflag) {
         unsigned char i;
         for (i=0; i<=0xF; i++) printf("%s: 0x%X --> %i\n",
@@ -77,22 +833,229 @@ void debug(FLAG dflag, char* mfile) {
         fclose(fpmem);
     }
 }
+#endif
 
-void ctrl_c(int x) {
-    printf("\n");
+/* the newline goes out once execution has stopped, so that
+ * it lands at the same place in the output on --replay */
+static void ctrl_c(int x) {
     halt = 1;
+    interrupted = 1;
     exit_code = 0;
 }
 
-void execute(FLAG iflag) {
+/* [*p] += v wrapped to the register width, return the old value */
+static unsigned int atomic_add(unsigned int* p, unsigned int v) {
+    unsigned int old = __atomic_load_n(p, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(p, &old, (old + v) & regmask,
+                1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+    return old & regmask;
+}
+
+static void execute(unsigned int start, FLAG iflag);
+
+/* what a new thread starts from, copied from its parent */
+typedef struct {
+    Vm* vm;
+    Thread* thread;
+    unsigned int pc, slot, reg[REGISTERS], arrayX[XSLOTS];
+    FLAG wide, iflag;
+} Spawn;
+
+static void* thread_main(void* arg) {
+    Spawn* s = arg;
+
+    use_vm(s->vm);
+    thread_init();
+    memcpy(reg, s->reg, sizeof(reg));
+    memcpy(arrayX, s->arrayX, sizeof(s->arrayX));
+    X = &arrayX[s->slot];
+    wide = s->wide;
+    regmask = wide ? 0xFFFFFFFF : 0xFFF;
+
+    execute(s->pc, s->iflag);
+    flush_out();
+    fold_regions();
+    s->thread->exit_code = exit_code;
+
+    thread_free();
+    free(s);
+    return NULL;
+}
+
+/* start a host thread running the guest from a,
+ * return its id, 0 if there is no room for it */
+static unsigned int spawn(unsigned int a, FLAG iflag) {
+    Spawn* s;
+    sigset_t block, old;
+    unsigned int i;
+
+    pthread_mutex_lock(&vm->lock);
+    for (i=0; i<THREADS && vm->threads[i].used; i++);
+    if (i < THREADS) vm->threads[i].used = 1;
+    pthread_mutex_unlock(&vm->lock);
+    if (i == THREADS) return 0;
+
+    s = malloc(sizeof(*s));
+    s->vm = vm;
+    s->thread = &vm->threads[i];
+    s->pc = a;
+    s->slot = X - arrayX;
+    memcpy(s->reg, reg, sizeof(reg));
+    s->reg[0] = 0;
+    memcpy(s->arrayX, arrayX, sizeof(s->arrayX));
+    s->wide = wide;
+    s->iflag = iflag;
+
+    // ^C is for the main thread, the others inherit this mask
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+    if (pthread_create(&vm->threads[i].id, NULL, thread_main, s)) {
+        free(s);
+        vm->threads[i].used = 0;
+        i = THREADS;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    return i == THREADS ? 0 : i + 1;
+}
+
+/* wait for thread id to finish and store its exit code,
+ * 1 if there is no such thread */
+static char join(unsigned int id, unsigned int* code) {
+    Thread* t;
+
+    if (!id || id > THREADS || !vm->threads[id - 1].used) return 1;
+    t = &vm->threads[id - 1];
+    pthread_join(t->id, NULL);
+    *code = t->exit_code;
+    pthread_mutex_lock(&vm->lock);
+    t->used = 0;
+    pthread_mutex_unlock(&vm->lock);
+    return 0;
+}
+
+/* wait for the threads nobody joined */
+static void join_all(void) {
+    unsigned int i, code;
+    for (i=1; i<=THREADS; i++) join(i, &code);
+}
+
+/* back off while the other end of a channel catches up: spin
+ * a while, then give the core away */
+static void relax(unsigned int spins) {
+    if (spins < 0x100) {
+#ifdef __SSE2__
+        _mm_pause();
+#endif
+    } else
+        sched_yield();
+}
+
+/* queue the n cells from a as one message on c, waiting for room;
+ * 1 if the message can never fit */
+static char chan_send(Channel* c, unsigned int a, unsigned int n) {
+    size_t tail = c->tail, at;
+    unsigned int j, first, spins = 0;
+
+    n = span(a, n);
+    if (!n) return 0;
+    if (n >= CHANSIZE) return 1;
+    while (tail + n + 1 - __atomic_load_n(&c->head, __ATOMIC_ACQUIRE)
+            > CHANSIZE) {
+        // nobody is going to read it
+        if (__atomic_load_n(&c->gone, __ATOMIC_ACQUIRE) || interrupted)
+            return 0;
+        relax(spins++);
+    }
+
+    c->cells[tail++ % CHANSIZE] = n;
+    at = tail % CHANSIZE;
+    if (flat(a, n)) {
+        first = CHANSIZE - at < n ? CHANSIZE - at : n;
+        memcpy(&c->cells[at], &memory[a], first * sizeof(*memory));
+        memcpy(c->cells, &memory[a + first],
+               (n - first) * sizeof(*memory));
+    } else
+        for (j=0; j<n; j++) c->cells[(at + j) % CHANSIZE] = PEEK(a + j);
+    __atomic_store_n(&c->tail, tail + n, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* take the next message off c, waiting for one, and store up to
+ * n cells of it from a; return its length, 0 once the sender
+ * has stopped and everything it sent was read */
+static unsigned int chan_recv(Channel* c, unsigned int a, unsigned int n) {
+    size_t head = c->head, at;
+    unsigned int j, len, first, spins = 0;
+
+    while (__atomic_load_n(&c->tail, __ATOMIC_ACQUIRE) == head) {
+        if (interrupted) return 0;
+        // done is set after the last message went in
+        if (__atomic_load_n(&c->done, __ATOMIC_ACQUIRE) &&
+                __atomic_load_n(&c->tail, __ATOMIC_ACQUIRE) == head)
+            return 0;
+        relax(spins++);
+    }
+
+    len = c->cells[head++ % CHANSIZE];
+    n = span(a, len < n ? len : n);
+    at = head % CHANSIZE;
+    if (flat(a, n)) {
+        first = CHANSIZE - at < n ? CHANSIZE - at : n;
+        memcpy(&memory[a], &c->cells[at], first * sizeof(*memory));
+        memcpy(&memory[a + first], c->cells,
+               (n - first) * sizeof(*memory));
+        dirty_range(a, n);
+        unverify(a, n);
+    } else
+        for (j=0; j<n; j++) POKE(a + j, c->cells[(at + j) % CHANSIZE]);
+    __atomic_store_n(&c->head, head + len, __ATOMIC_RELEASE);
+    return len;
+}
+
+#ifndef LIBPVM
+/* a new channel from program a to program b, 1 if either
+ * has run out of channel numbers */
+static char chan_connect(Vm* a, Vm* b) {
+    Channel* c;
+
+    if (a->nout == CHANNELS || b->nin == CHANNELS) return 1;
+    c = calloc(1, sizeof(*c));
+    if (!c) return 1;
+    pthread_mutex_init(&c->sending, NULL);
+    pthread_mutex_init(&c->receiving, NULL);
+    a->out[a->nout++] = c;
+    b->in[b->nin++] = c;
+    return 0;
+}
+#endif
+
+/* tell the other ends of this program's channels it has stopped */
+static void close_channels(void) {
+    unsigned int i;
+    for (i=0; i<vm->nout; i++)
+        __atomic_store_n(&vm->out[i]->done, 1, __ATOMIC_RELEASE);
+    for (i=0; i<vm->nin; i++)
+        __atomic_store_n(&vm->in[i]->gone, 1, __ATOMIC_RELEASE);
+}
+
+static void execute(unsigned int start, FLAG iflag) {
     unsigned char i;
     unsigned int j;
     size_t linesize;
 
     char line[MEMSIZE] = {0};
-    X = &arrayX[0];
 
-    for (pc=0; halt != 1 && pc < MEMSIZE;) {
+    for (pc=start; halt != 1 && !interrupted && pc < MEMSIZE; icount++) {
+        if (icount == stop_at) {
+            // where the recorded run got ^C
+            ctrl_c(SIGINT);
+            break;
+        }
+        // the program's threads count into the same profile
+        if (profile) __atomic_fetch_add(&profile[pc], 1, __ATOMIC_RELAXED);
+
         // Getting opcode
         opcode = memory[pc++];
         opcode <<= 8;
@@ -121,7 +1084,7 @@ void execute(FLAG iflag) {
                 // 01xnnn
                 // rx = nnn
                 reg[x] = nnn;
-                reg[x] &= 0xFFF;
+                reg[x] &= regmask;
                 break;
             case 0x2:
                 // 02x00k
@@ -130,8 +1093,8 @@ void execute(FLAG iflag) {
                         // fill r0 to rx with values from memory
                         // starting at address [X]
                         for (i=0; i<=x; i++) {
-                            reg[i] = memory[*X + i];
-                            reg[i] &= 0xFFF;
+                            reg[i] = PEEK(*X + i);
+                            reg[i] &= regmask;
                         }
                         break;
 
@@ -139,8 +1102,8 @@ void execute(FLAG iflag) {
                         // stores r0 to rx in memory starting
                         // at address [X]
                         for (i=0; i<=x; i++) {
-                            reg[i] &= 0xFFF;
-                            memory[*X + i] = reg[i];
+                            reg[i] &= regmask;
+                            POKE(*X + i, reg[i]);
                         }
                         break;
                         break;
@@ -148,14 +1111,14 @@ void execute(FLAG iflag) {
                     case 0x2:
                         // load value from address [X] into
                         // register x
-                        reg[x] = memory[*X];
-                        reg[x] &= 0xFFF;
+                        reg[x] = PEEK(*X);
+                        reg[x] &= regmask;
                         break;
 
                     case 0x3:
                         // store rx into memory address [X]
-                        reg[x] &= 0xFFF;
-                        memory[*X] = reg[x];
+                        reg[x] &= regmask;
+                        POKE(*X, reg[x]);
                         break;
 
                     default:
@@ -180,21 +1143,22 @@ void execute(FLAG iflag) {
                 break;
             case 0x5:
                 // 05xnnn
+                if (outlen) flush_out();
                 switch (x) {
                     case 0x0:
                         // print values from address [X]
                         // until 0x0 is found
                         memset(line, '\0', MEMSIZE);
                         for (j=0; j + *X<MEMSIZE &&
-                                memory[j + *X] != 0x0; j++)
-                            line[j] = memory[j + *X];
+                                PEEK(j + *X) != 0x0; j++)
+                            line[j] = PEEK(j + *X);
                         printf("%s", line);
                         break;
                     case 0x1:
                         // print nnn values from address [X]
                         memset(line, '\0', MEMSIZE);
                         for (j=0; j + *X < MEMSIZE && j < nnn; j++)
-                            line[j] = memory[j + *X];
+                            line[j] = PEEK(j + *X);
                         printf("%s", line);
                         break;
                     case 0x2:
@@ -203,7 +1167,7 @@ void execute(FLAG iflag) {
                         break;
                     case 0x3:
                         // print one integer from address [X]
-                        printf("%i", memory[*X]);
+                        printf("%i", PEEK(*X));
                         break;
 
                     default:
@@ -218,10 +1182,12 @@ void execute(FLAG iflag) {
             case 0x6:
                 // 060000
                 // get input from user and store it at address [X]
-                linesize = readline(line, MEMSIZE);
-                for (j=0; j <= linesize; j++) {
-                    memory[j + *X] = line[j];
-                }
+                if (outlen) flush_out();
+                linesize = getinput(line, MEMSIZE);
+                // the line and its '\0', as much as fits in memory
+                linesize = span(*X, linesize + 1);
+                for (j=0; j < linesize; j++)
+                    POKE(j + *X, line[j]);
                 break;
             case 0x7:
                 // 07xnnn
@@ -270,25 +1236,31 @@ void execute(FLAG iflag) {
                 // 0Cxnnn
                 // add nnn to rx
                 reg[x] += nnn;
-                reg[x] &= 0xFFF;
+                reg[x] &= regmask;
                 break;
             case 0xD:
                 // 0Dxnnn
                 // sub nnn from rx
                 reg[x] -= nnn;
-                reg[x] &= 0xFFF;
+                reg[x] &= regmask;
                 break;
             case 0xE:
                 // 0Exnnn
                 // mul rx by nnn
                 reg[x] *= nnn;
-                reg[x] &= 0xFFF;
+                reg[x] &= regmask;
                 break;
             case 0xF:
                 // 0Fxnnn
                 // div rx by nnn
+                if (!nnn) {
+                    fprintf(stderr,
+                        "%s: division by zero at @%04X\n",
+                        PROGNAME, pc - 3);
+                    return;
+                }
                 reg[x] /= nnn;
-                reg[x] &= 0xFFF;
+                reg[x] &= regmask;
                 break;
             case 0x10:
                 // 10xy0k
@@ -296,28 +1268,57 @@ void execute(FLAG iflag) {
                     case 0x0:
                         // add ry to rx
                         reg[x] += reg[y];
-                        reg[x] &= 0xFFF;
+                        reg[x] &= regmask;
                         break;
                     case 0x1:
                         // sub ry from rx
                         reg[x] -= reg[y];
-                        reg[x] &= 0xFFF;
+                        reg[x] &= regmask;
                         break;
                     case 0x2:
                         // mul rx by ry
                         reg[x] *= reg[y];
-                        reg[x] &= 0xFFF;
+                        reg[x] &= regmask;
                         break;
                     case 0x3:
                         // div rx by ry
+                        if (!reg[y]) {
+                            fprintf(stderr,
+                                "%s: division by zero at @%04X\n",
+                                PROGNAME, pc - 3);
+                            return;
+                        }
                         reg[x] /= reg[y];
-                        reg[x] &= 0xFFF;
+                        reg[x] &= regmask;
                         break;
                     case 0x4:
                         // rx = ry
-                        reg[y] &= 0xFF;
+                        if (!wide) reg[y] &= 0xFF;
                         reg[x] = reg[y];
                         break;
+                    case 0x5:
+                        // shift rx left by ry
+                        reg[x] <<= reg[y] & 0x1F;
+                        reg[x] &= regmask;
+                        break;
+                    case 0x6:
+                        // shift rx right by ry
+                        reg[x] >>= reg[y] & 0x1F;
+                        break;
+                    case 0x7:
+                        // rx &= ry
+                        reg[x] &= reg[y];
+                        break;
+                    case 0x8:
+                        // rx |= ry
+                        reg[x] |= reg[y];
+                        reg[x] &= regmask;
+                        break;
+                    case 0x9:
+                        // rx ^= ry
+                        reg[x] ^= reg[y];
+                        reg[x] &= regmask;
+                        break;
 
                     default:
                         fprintf(stderr,
@@ -331,12 +1332,24 @@ void execute(FLAG iflag) {
             case 0x11:
                 // 11mmmm
                 // call subroutine at address mmmm
+                if (!VERIFIED(pc - 3) && psp == stacksize) {
+                    fprintf(stderr,
+                        "%s: call stack overflow at @%04X\n",
+                        PROGNAME, pc - 3);
+                    return;
+                }
                 pc_stack[psp++] = pc;
                 pc = mmmm;
                 break;
             case 0x12:
                 // 120000
                 // return from a subroutine
+                if (!VERIFIED(pc - 3) && psp == 0) {
+                    fprintf(stderr,
+                        "%s: return without call at @%04X\n",
+                        PROGNAME, pc - 3);
+                    return;
+                }
                 pc = pc_stack[--psp];
                 break;
             case 0x13:
@@ -344,8 +1357,494 @@ void execute(FLAG iflag) {
                 // switch X to &arrayX[k]
                 X = &arrayX[k & 0xF];
                 break;
+            case 0x14:
+                // 14xy0k
+                switch (k) {
+                    case 0x0:
+                        // map window rx:ry of the bank
+                        // backing at BANKBASE
+                        if (!vm->bankmem && map_banks(NULL)) {
+                            fprintf(stderr,
+                                "%s: failed to map bank memory\n",
+                                PROGNAME);
+                            return;
+                        }
+                        winoff = (size_t)(reg[x] << 12 | reg[y]) *
+                                 BANKSTRIDE;
+                        banked = 1;
+                        break;
+                    case 0x1:
+                        // rx:ry = number of windows in the backing
+                        j = (vm->banklen + BANKSTRIDE - 1) / BANKSTRIDE;
+                        if (!vm->bankmem) j = ANONBANKS;
+                        reg[x] = (j >> 12) & 0xFFF;
+                        reg[y] = j & 0xFFF;
+                        break;
 
-            default:
+                    default:
+                        fprintf(stderr,
+                            "%s: unknown opcode at "
+                            "@%04X: 0x%06lX\n",
+                            PROGNAME, pc - 3, opcode);
+                        return;
+                        break;
+                }
+                break;
+
+            case 0x15:
+                // 15000k
+                // k = 1: 32 bit registers, k = 0: 12 bit registers
+                wide = k;
+                regmask = wide ? 0xFFFFFFFF : 0xFFF;
+                break;
+            case 0x16:
+                // 16xknn
+                switch (y) {
+                    case 0x0:
+                        // shift rx left by nn
+                        reg[x] <<= (opcode & 0xFF) & 0x1F;
+                        reg[x] &= regmask;
+                        break;
+                    case 0x1:
+                        // shift rx right by nn
+                        reg[x] >>= (opcode & 0xFF) & 0x1F;
+                        break;
+                    case 0x2:
+                        // rx &= nn
+                        reg[x] &= opcode & 0xFF;
+                        break;
+                    case 0x3:
+                        // rx |= nn
+                        reg[x] |= opcode & 0xFF;
+                        reg[x] &= regmask;
+                        break;
+                    case 0x4:
+                        // rx ^= nn
+                        reg[x] ^= opcode & 0xFF;
+                        reg[x] &= regmask;
+                        break;
+
+                    default:
+                        fprintf(stderr,
+                            "%s: unknown opcode at "
+                            "@%04X: 0x%06lX\n",
+                            PROGNAME, pc - 3, opcode);
+                        return;
+                        break;
+                }
+                break;
+            case 0x17:
+                // 17xnnn
+                // shift nnn into rx from the right,
+                // builds wide constants 12 bits at a time
+                reg[x] = reg[x] << 12 | nnn;
+                reg[x] &= regmask;
+                break;
+            case 0x18:
+                // 18dsnk, d and s select arrayX slots,
+                // n the register holding the cell count
+                j = (opcode >> 4) & 0xF;
+                switch (k) {
+                    case 0x0:
+                        // copy rn cells from [s] to [d]
+                        copy_cells(arrayX[x], arrayX[y], reg[j]);
+                        break;
+                    case 0x1:
+                        // fill rn cells at [d] with rs
+                        set_cells(arrayX[x], reg[y], reg[j]);
+                        break;
+                    case 0x2:
+                        // compare rn cells at [d] and [s],
+                        // rn = 0 if equal, 1 if [d] is less, 2 if greater
+                        reg[j] = compare_cells(arrayX[x], arrayX[y],
+                                               reg[j]);
+                        break;
+
+                    default:
+                        fprintf(stderr,
+                            "%s: unknown opcode at "
+                            "@%04X: 0x%06lX\n",
+                            PROGNAME, pc - 3, opcode);
+                        return;
+                        break;
+                }
+                break;
+            case 0x19:
+                // 19xy0k
+                switch (k) {
+                    case 0x0:
+                        // rx = length of the string at [X]
+                        reg[x] = find_cell(*X, MEMSIZE, 0);
+                        reg[x] &= regmask;
+                        break;
+                    case 0x1:
+                        // rx = offset of the first ry in the
+                        // rx cells at [X], rx if there is none
+                        reg[x] = find_cell(*X, reg[x], reg[y]);
+                        break;
+                    case 0x2:
+                        // rx = offset of the string at [arrayX[y]]
+                        // in the one at [X], all ones if absent
+                        reg[x] = find_string(*X, arrayX[y]);
+                        reg[x] &= regmask;
+                        break;
+                    case 0x3:
+                        // rx = CRC-32C of the ry cells at [X]
+                        reg[x] = crc32c(*X, reg[y]);
+                        reg[x] &= regmask;
+                        break;
+
+                    default:
+                        fprintf(stderr,
+                            "%s: unknown opcode at "
+                            "@%04X: 0x%06lX\n",
+                            PROGNAME, pc - 3, opcode);
+                        return;
+                        break;
+                }
+                break;
+
+            case 0x1A:
+                // 1Axnnn 04mmmm
+                // jump to mmmm if rx == nnn
+                BRANCH(reg[x] == nnn);
+                break;
+            case 0x1B:
+                // 1Bxnnn 04mmmm
+                // jump to mmmm if rx != nnn
+                BRANCH(reg[x] != nnn);
+                break;
+            case 0x1C:
+                // 1Cxnnn 04mmmm
+                // jump to mmmm if rx < nnn
+                BRANCH(reg[x] < nnn);
+                break;
+            case 0x1D:
+                // 1Dxnnn 04mmmm
+                // jump to mmmm if rx > nnn
+                BRANCH(reg[x] > nnn);
+                break;
+            case 0x1E:
+                // 1Exy0k 04mmmm
+                switch (k) {
+                    case 0x0:
+                        // jump to mmmm if rx == ry
+                        BRANCH(reg[x] == reg[y]);
+                        break;
+                    case 0x1:
+                        // jump to mmmm if rx != ry
+                        BRANCH(reg[x] != reg[y]);
+                        break;
+                    case 0x2:
+                        // jump to mmmm if rx < ry
+                        BRANCH(reg[x] < reg[y]);
+                        break;
+                    case 0x3:
+                        // jump to mmmm if rx > ry
+                        BRANCH(reg[x] > reg[y]);
+                        break;
+
+                    default:
+                        fprintf(stderr,
+                            "%s: unknown opcode at "
+                            "@%04X: 0x%06lX\n",
+                            PROGNAME, pc - 3, opcode);
+                        return;
+                        break;
+                }
+                break;
+            case 0x1F:
+                // 1Fx00k
+                // k = 0, 1: jump to, call address rx
+                // k = 2, 3: jump to, call the address stored in
+                // the two cells at [X] + 2 * rx, high byte first
+                if (k & 0x2) {
+                    j = (*X + 2 * reg[x]) & 0xFFFF;
+                    j = PEEK(j) << 8 | PEEK(j + 1);
+                } else
+                    j = reg[x];
+
+                if (k & 0x1) {
+                    if (psp == stacksize) {
+                        fprintf(stderr,
+                            "%s: call stack overflow at @%04X\n",
+                            PROGNAME, pc - 3);
+                        return;
+                    }
+                    pc_stack[psp++] = pc;
+                }
+                pc = j;
+                break;
+            case 0x20:
+                // 20xy0k
+                switch (k) {
+                    case 0x0:
+                        // push rx onto the data stack
+                        if (dsp == stacksize) {
+                            fprintf(stderr,
+                                "%s: data stack overflow at @%04X\n",
+                                PROGNAME, pc - 3);
+                            return;
+                        }
+                        data_stack[dsp++] = reg[x];
+                        break;
+                    case 0x1:
+                        // pop rx from the data stack
+                        if (!dsp) {
+                            fprintf(stderr,
+                                "%s: data stack underflow at @%04X\n",
+                                PROGNAME, pc - 3);
+                            return;
+                        }
+                        reg[x] = data_stack[--dsp] & regmask;
+                        break;
+                    case 0x2:
+                        // push rx to ry
+                        if (y < x || dsp + (y - x) + 1 > stacksize) {
+                            fprintf(stderr,
+                                "%s: data stack overflow at @%04X\n",
+                                PROGNAME, pc - 3);
+                            return;
+                        }
+                        memcpy(&data_stack[dsp], &reg[x],
+                               (y - x + 1) * sizeof(*reg));
+                        dsp += y - x + 1;
+                        break;
+                    case 0x3:
+                        // pop ry down to rx, undoing a push rx to ry
+                        if (y < x || dsp < (unsigned int)(y - x) + 1) {
+                            fprintf(stderr,
+                                "%s: data stack underflow at @%04X\n",
+                                PROGNAME, pc - 3);
+                            return;
+                        }
+                        dsp -= y - x + 1;
+                        memcpy(&reg[x], &data_stack[dsp],
+                               (y - x + 1) * sizeof(*reg));
+                        break;
+
+                    default:
+                        fprintf(stderr,
+                            "%s: unknown opcode at "
+                            "@%04X: 0x%06lX\n",
+                            PROGNAME, pc - 3, opcode);
+                        return;
+                        break;
+                }
+                break;
+            case 0x21:
+                // 21x00k
+                switch (k) {
+                    case 0x0:
+                        // [X] = address of a new block of rx cells,
+                        // 0 if the heap is exhausted
+                        pthread_mutex_lock(&vm->lock);
+                        *X = heap_alloc(reg[x]);
+                        pthread_mutex_unlock(&vm->lock);
+                        break;
+                    case 0x1:
+                        // free the block at [X]
+                        pthread_mutex_lock(&vm->lock);
+                        j = heap_free(*X);
+                        pthread_mutex_unlock(&vm->lock);
+                        if (j) {
+                            fprintf(stderr,
+                                "%s: free of unallocated @%04X "
+                                "at @%04X\n", PROGNAME, *X, pc - 3);
+                            return;
+                        }
+                        break;
+                    case 0x2:
+                        // free every block
+                        pthread_mutex_lock(&vm->lock);
+                        heap_reset();
+                        pthread_mutex_unlock(&vm->lock);
+                        break;
+
+                    default:
+                        fprintf(stderr,
+                            "%s: unknown opcode at "
+                            "@%04X: 0x%06lX\n",
+                            PROGNAME, pc - 3, opcode);
+                        return;
+                        break;
+                }
+                break;
+            case 0x22:
+                // 22x00k
+                switch (k) {
+                    case 0x0:
+                        // parse decimal at [X] into rx
+                        reg[x] = parse_number(0);
+                        break;
+                    case 0x1:
+                        // parse hex at [X] into rx
+                        reg[x] = parse_number(1);
+                        break;
+                    case 0x2:
+                        // format rx in decimal
+                        format_number(reg[x], 0);
+                        break;
+                    case 0x3:
+                        // format rx in hex
+                        format_number(reg[x], 1);
+                        break;
+                    case 0x4:
+                        // format the rx cells at [X] in decimal,
+                        // separated by spaces
+                        for (j=0; j<span(*X, reg[x]); j++) {
+                            if (j) outbuf[outlen++] = ' ';
+                            format_number(PEEK(*X + j), 0);
+                        }
+                        break;
+                    case 0x5:
+                        // write out what was formatted
+                        flush_out();
+                        break;
+
+                    default:
+                        fprintf(stderr,
+                            "%s: unknown opcode at "
+                            "@%04X: 0x%06lX\n",
+                            PROGNAME, pc - 3, opcode);
+                        return;
+                        break;
+                }
+                break;
+            case 0x23:
+                // 23xy0k
+                switch (k) {
+                    case 0x0:
+                        // rx:ry = instructions executed so far
+                        split(icount);
+                        break;
+                    case 0x1:
+                        // rx:ry = monotonic clock in nanoseconds
+                        split(nanoseconds());
+                        break;
+
+                    default:
+                        fprintf(stderr,
+                            "%s: unknown opcode at "
+                            "@%04X: 0x%06lX\n",
+                            PROGNAME, pc - 3, opcode);
+                        return;
+                        break;
+                }
+                break;
+            case 0x24:
+                // 240knn
+                // k = 0: enter, k = 1: leave profiling region nn
+                region(opcode & 0xFF, y);
+                break;
+            case 0x25:
+                // 2500nn
+                // call native function nn
+                if (!hostcalls[opcode & 0xFF]) {
+                    fprintf(stderr,
+                        "%s: no host function %02lX at @%04X\n",
+                        PROGNAME, opcode & 0xFF, pc - 3);
+                    return;
+                }
+                hostcalls[opcode & 0xFF](reg, memory, X);
+                for (i=0; i<REGISTERS; i++) reg[i] &= regmask;
+                // it may have written anywhere
+                dirty_range(0, MEMSIZE);
+                if (!__atomic_load_n(&vm->hosted, __ATOMIC_ACQUIRE)) {
+                    unverify(0, MEMSIZE);
+                    __atomic_store_n(&vm->hosted, 1, __ATOMIC_RELEASE);
+                }
+                break;
+            case 0x26:
+                // 26mmmm
+                // start a thread at mmmm, r0 = its id, 0 if none
+                // could be started; the thread sees r0 = 0
+                reg[0] = spawn(mmmm, iflag);
+                break;
+            case 0x27:
+                // 27xy0k
+                if (k == 0x0) {
+                    // wait for thread rx, rx = its exit code
+                    if (join(reg[x], &reg[x])) {
+                        fprintf(stderr,
+                            "%s: join of unknown thread %u "
+                            "at @%04X\n", PROGNAME, reg[x], pc - 3);
+                        return;
+                    }
+                    break;
+                }
+                if (k == 0x3) {
+                    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+                    break;
+                }
+                if (*X >= MEMSIZE || !flat(*X, 1)) {
+                    fprintf(stderr,
+                        "%s: atomic access to @%04X outside "
+                        "memory at @%04X\n", PROGNAME, *X, pc - 3);
+                    return;
+                }
+                switch (k) {
+                    case 0x1:
+                        // [X] += rx, rx = old [X]
+                        reg[x] = atomic_add(&memory[*X], reg[x]);
+                        break;
+                    case 0x2:
+                        // if [X] == rx: [X] = ry; rx = old [X]
+                        j = reg[x];
+                        __atomic_compare_exchange_n(&memory[*X], &j,
+                            reg[y], 0, __ATOMIC_SEQ_CST,
+                            __ATOMIC_SEQ_CST);
+                        reg[x] = j & regmask;
+                        break;
+
+                    default:
+                        fprintf(stderr,
+                            "%s: unknown opcode at "
+                            "@%04X: 0x%06lX\n",
+                            PROGNAME, pc - 3, opcode);
+                        return;
+                        break;
+                }
+                DIRTY(*X);
+                unverify(*X, 1);
+                break;
+            case 0x28:
+                // 28xc0k
+                // k = 0: send rx cells from [X] on channel c
+                // k = 1: receive into at most rx cells at [X] from
+                //        channel c, rx = length of the message,
+                //        0 at the end of the stream
+                if (k > 0x1) {
+                    fprintf(stderr,
+                        "%s: unknown opcode at @%04X: 0x%06lX\n",
+                        PROGNAME, pc - 3, opcode);
+                    return;
+                }
+                if (y >= (k ? vm->nin : vm->nout)) {
+                    fprintf(stderr,
+                        "%s: channel %X not connected at @%04X\n",
+                        PROGNAME, y, pc - 3);
+                    return;
+                }
+                if (k) {
+                    pthread_mutex_lock(&vm->in[y]->receiving);
+                    j = chan_recv(vm->in[y], *X, reg[x]);
+                    pthread_mutex_unlock(&vm->in[y]->receiving);
+                    reg[x] = j > regmask ? regmask : j;
+                    break;
+                }
+                pthread_mutex_lock(&vm->out[y]->sending);
+                j = chan_send(vm->out[y], *X, reg[x]);
+                pthread_mutex_unlock(&vm->out[y]->sending);
+                if (j) {
+                    fprintf(stderr,
+                        "%s: message too long for channel at "
+                        "@%04X\n", PROGNAME, pc - 3);
+                    return;
+                }
+                break;
+
+            default:
                 fprintf(stderr,
                     "%s: unknown opcode at @%04X: 0x%06lX\n",
                     PROGNAME, pc - 3, opcode);
@@ -355,17 +1854,133 @@ void execute(FLAG iflag) {
     }
 }
 
+/* run the program from the start, wait for every thread it
+ * started, then close its channels; return its exit code */
+static unsigned int run(FLAG iflag) {
+    execute(0, iflag);
+    flush_out();
+    join_all();
+    fold_regions();
+    close_channels();
+    return exit_code;
+}
+
+#ifndef LIBPVM
+static void* stage_main(void* arg) {
+    Spawn* s = arg;
+
+    use_vm(s->vm);
+    thread_init();
+    s->vm->exit_code = run(s->iflag);
+    thread_free();
+    free(s);
+    return NULL;
+}
+
+/* run all of program v on a thread of its own */
+static void start_stage(Vm* v, FLAG iflag, pthread_t* id) {
+    Spawn* s = calloc(1, sizeof(*s));
+    sigset_t block, old;
+
+    s->vm = v;
+    s->iflag = iflag;
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+    if (pthread_create(id, NULL, stage_main, s)) {
+        fprintf(stderr, "%s: failed to start a thread.\n", PROGNAME);
+        exit(EXIT_FAILURE);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/* connect programs as `a:b,...' says, channels from a to b with
+ * a and b numbered from 0 in command line order */
+static char topology(char* spec, Vm* stages[], unsigned int n) {
+    unsigned long a, b;
+    char* end;
+
+    while (*spec) {
+        a = strtoul(spec, &end, 10);
+        if (end == spec || *end != ':') return 1;
+        spec = end + 1;
+        b = strtoul(spec, &end, 10);
+        if (end == spec || a >= n || b >= n || a == b) return 1;
+        if (*end == ',') end++;
+        else if (*end) return 1;
+        spec = end;
+        if (chan_connect(stages[a], stages[b])) return 1;
+    }
+    return 0;
+}
+
+/* connect each program to the next one */
+static char chain(Vm* stages[], unsigned int n) {
+    unsigned int i;
+    for (i=0; i+1<n; i++)
+        if (chan_connect(stages[i], stages[i + 1])) return 1;
+    return 0;
+}
+#endif
+
+void pvm_register(unsigned char n, pvm_hostcall fn) {
+    hostcalls[n] = fn;
+}
+
+void pvm_init(unsigned int depth) {
+    if (depth) stacksize = depth;
+    use_vm(new_vm());
+    thread_init();
+}
+
+char pvm_load(FILE* fp) {
+    if (load(fp)) {
+        fprintf(stderr, "%s: memory overflow (file too big).\n",
+                PROGNAME);
+        return 1;
+    }
+    if (verify() && strict) {
+        fprintf(stderr, "%s: program failed verification.\n",
+                PROGNAME);
+        return 1;
+    }
+    return 0;
+}
+
+unsigned int pvm_run(void) {
+    return run(0);
+}
+
+#ifndef LIBPVM
+/* hostcall 0: sort the r0 cells at [X] */
+static int compare_uint(const void* a, const void* b) {
+    unsigned int ua = *(const unsigned int*)a;
+    unsigned int ub = *(const unsigned int*)b;
+    return (ua > ub) - (ua < ub);
+}
+
+static void host_sort(unsigned int* reg, unsigned int* memory,
+                      unsigned int* X) {
+    qsort(&memory[*X], span(*X, reg[0]), sizeof(*memory), compare_uint);
+}
+
 int main(int argc, char* argv[]) {
     PROGNAME = argv[0];
     FLAG  dflag = 0;
     FLAG  iflag = 0;
     char* mfile = NULL;
+    char* bfile = NULL;
+    char* tspec = NULL;
+    char* pfile = NULL;
     char* fn = NULL;
+    Vm* stages[STAGES];
+    pthread_t ids[STAGES];
     int c;
 
     opterr = 0;
 
-    while ((c = getopt(argc, argv, "hdm:vi")) != -1)
+    while ((c = getopt_long(argc, argv, "hdm:virVb:s:t:p:",
+                    long_options, NULL)) != -1)
         switch (c) {
             case 'h':
                 print_usage();
@@ -382,11 +1997,53 @@ int main(int argc, char* argv[]) {
             case 'i':
                 iflag = 1;
                 break;
+            case 'r':
+                rflag = 1;
+                break;
+            case 'V':
+                strict = 1;
+                break;
+            case 'b':
+                bfile = optarg;
+                break;
+            case 't':
+                tspec = optarg;
+                break;
+            case 'p':
+                pfile = optarg;
+                break;
+            case 'R':
+                recfile = fopen(optarg, "wb");
+                if (!recfile) {
+                    fprintf(stderr,
+                        "%s: failed to open log: `%s'.\n",
+                        PROGNAME, optarg);
+                    return 1;
+                }
+                break;
+            case 'P':
+                if (open_replay(optarg)) {
+                    fprintf(stderr,
+                        "%s: failed to read log: `%s'.\n",
+                        PROGNAME, optarg);
+                    return 1;
+                }
+                break;
+            case 's':
+                stacksize = strtoul(optarg, NULL, 0);
+                if (!stacksize) {
+                    fprintf(stderr,
+                        "%s: bad stack depth: `%s'.\n",
+                        PROGNAME, optarg);
+                    return 1;
+                }
+                break;
             case '?':
-                if (optopt == 'm')
+                if (optopt == 'm' || optopt == 'b' || optopt == 's' ||
+                        optopt == 't' || optopt == 'p')
                     fprintf(stderr,
-                        "%s: option `m' expects an argument.\n",
-                        PROGNAME);
+                        "%s: option `%c' expects an argument.\n",
+                        PROGNAME, optopt);
                 else if (isprint(optopt))
                     fprintf(stderr,
                         "%s: unknown option: `-%c'.\n",
@@ -403,32 +2060,85 @@ int main(int argc, char* argv[]) {
         }
 
     argc -= optind;
-    switch (argc) {
-        case 1:
-            fn = argv[optind];
-            break;
-        default:
-            print_usage();
-            break;
-    }
-
-    FILE* fp = fopen(fn, "rb");
-    if (!fp) {
-        fprintf(stderr, "%s: failed to open file: `%s'.\n",
-                PROGNAME, fn);
+    if (argc < 1 || argc > STAGES) print_usage();
+    if (rflag && argc > 1) {
+        fprintf(stderr, "%s: per-record mode runs a single program.\n",
+                PROGNAME);
         return 1;
     }
-    if (load(fp)) {
-        fprintf(stderr, "%s: memory overflow (file too big).\n",
+    if (pfile && argc > 1) {
+        fprintf(stderr, "%s: -p profiles a single program.\n",
                 PROGNAME);
         return 1;
     }
-    fclose(fp);
+
+    pvm_init(0);
+    pvm_register(0x00, host_sort);
+
+    for (c=0; c<argc; c++) {
+        if (c) use_vm(new_vm());
+        stages[c] = vm;
+        fn = argv[optind + c];
+
+        if (bfile && map_banks(bfile)) {
+            fprintf(stderr, "%s: failed to map bank file: `%s'.\n",
+                    PROGNAME, bfile);
+            return 1;
+        }
+
+        FILE* fp = fopen(fn, "rb");
+        if (!fp) {
+            fprintf(stderr, "%s: failed to open file: `%s'.\n",
+                    PROGNAME, fn);
+            return 1;
+        }
+        if (pvm_load(fp)) return 1;
+        fclose(fp);
+    }
+
+    if (tspec ? topology(tspec, stages, argc) : chain(stages, argc)) {
+        fprintf(stderr, "%s: bad topology: `%s'.\n",
+                PROGNAME, tspec ? tspec : "");
+        return 1;
+    }
+
+    if (pfile) {
+        vm->profile = calloc(MEMSIZE, sizeof(*profile));
+        use_vm(vm);
+    }
 
     signal(SIGINT, ctrl_c);
-    execute(iflag);
+    if (rflag) {
+        // keep the loaded image around to reset from
+        memcpy(image, memory, sizeof(image));
+        for (c=0; !interrupted && next_record(); c++) {
+            if (c) reset();
+            run(iflag);
+        }
+    } else {
+        // the last program runs here, the others on their own threads
+        for (c=0; c<argc-1; c++) start_stage(stages[c], iflag, &ids[c]);
+        use_vm(stages[argc - 1]);
+        run(iflag);
+        for (c=0; c<argc-1; c++) pthread_join(ids[c], NULL);
+    }
 
+    if (interrupted) printf("\n");
+    if (recfile) {
+        if (interrupted)
+            fprintf(recfile, "sigint %llu\n", icount);
+        fclose(recfile);
+    }
+
+    for (c=0; c<argc; c++)
+        report_regions(stages[c], argc > 1 ? argv[optind + c] : NULL);
+    if (pfile && write_profile(pfile)) {
+        fprintf(stderr, "%s: failed to write profile: `%s'.\n",
+                PROGNAME, pfile);
+        return 1;
+    }
     debug(dflag, mfile);
 
     exit(exit_code);
 }
+#endif